@@ -6,7 +6,7 @@
  * See LICENSE.md for specifics.
  *
  * A simple utility to allow connecting to the CONSOLE keyboard and
- * mouse (TODO: add mouse passthrough)
+ * mouse
  *
  * In its simplest mode, it takes raw ASCII from keyboard and converts this
  * to the appropriate keyboard scancodes, stuffed into keyboard queue of
@@ -14,12 +14,11 @@
  * input queue.  Very handy.
  *
  * ------IDEAS-------
- * TODO: (-m) mouse support + option to enable (not enabled by default)
- *            This likely only possible with (-r) remote mode. Involves
- *            grabbing events for mouse/kb to pass along.
- * TODO: (-r) remote mode. Like how rsync does it, connect to remote system,
- *            talk to itself on that machine, connect and begin passing
- *            kb/mouse events.
+ * DONE: (-m) mouse support, off by default.  From the terminal's own
+ *            mouse reports, or a local mouse grabbed and passed along.
+ * DONE: remote mode (-o tcp:/unix:/ssh: and -L). Like how rsync does it,
+ *            connect to remote system, talk to itself on that machine,
+ *            connect and begin passing kb/mouse events.
  *
  * <lornix@lornix.com> 2014-06-15
  *
@@ -39,6 +38,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <time.h>
 #include <linux/uinput.h>
 #include <error.h>
 #include <errno.h>
@@ -46,8 +46,35 @@
 #include <termios.h>
 #include <sys/kd.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/syscall.h>
+#include <sys/fsuid.h>
+#include <linux/io_uring.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /* #include <linux/input.h>                               */
 /* not needed, since <linux/uinput.h> includes it already */
@@ -70,14 +97,259 @@ static const int MAX_LINE_LENGTH=70;
 /* Maximum rdelay/cdelay value, in milliseconds */
 static const int MAX_DELAY=2000;
 
+/* fastest pacing rate, chars/sec, and biggest burst */
+static const int MAX_RATE=100000;
+static const int MAX_BURST=10000;
+
+/* size of outbound event buffer, in events (24 bytes each on 64bit) */
+#define EVBUF_MAX 1024
+
+/* most keys -O will press in one SYN frame */
+#define OPT_FRAME_MAX 64
+
+/* worst case events for one optimized stroke, and settling afterwards: */
+/* every transition in its own frame, then all 4 modifiers up and SYN   */
+#define OPT_STROKE_EVENTS (10*2+5)
+
+/* default number of queued events which triggers a write, 0 means */
+/* every keystroke gets its own write                               */
+static const int BATCH_DEFAULT=256;
+
 /* escape_char - what character is the escape char? Can't leave without it! */
 static const char escape_char_default='%';
 static int verbose_mode=0;
 static int rdelay=-1;
 static int cdelay=-1;
 
-/* file descriptor to write to uinput device */
-static int ufile=0;
+/* queued events which trigger a write, see BATCH_DEFAULT */
+static int batch_events=-1;
+
+/* where echo, -v notes and terminal requests go: stdout, unless the */
+/* events are going there (capture:-)                                */
+static int log_fd=1;
+
+/* who puts the time in each event? uinput ignores it, so default to kernel */
+typedef enum { TS_KERNEL, TS_FRAME } ts_policy;
+static ts_policy timestamp_policy=TS_KERNEL;
+
+/* running totals, reported with -v */
+static unsigned long stat_chars=0;
+static unsigned long stat_reads=0;
+static unsigned long stat_unmapped=0;
+static unsigned long stat_bytes=0;
+
+/* Latencies, HDR style: exact below 16ns, then 8 buckets for every */
+/* power of two, so each is within an eighth of its bucket's top.  */
+/* Cheap to add to and merge, near enough for percentiles          */
+#define HIST_BUCKETS (16+60*8)
+typedef struct {
+    unsigned long count;
+    unsigned long buckets[HIST_BUCKETS];
+    long long total;
+    long long max;
+} latency_hist;
+
+/* The hot path's stages, timed for the main output and dumped on     */
+/* SIGUSR1, to anyone connecting to the stats socket (-Q), and at     */
+/* exit with -v.  Clocks aren't free, so translation (per character)  */
+/* and writes are timed one in STATS_SAMPLE; the rest every time.     */
+enum { STAGE_READ, STAGE_ESCAPE, STAGE_TRANSLATE, STAGE_WRITE, STAGE_PACE, STAGES };
+static const char* stage_names[]={ "read", "escape", "translate", "write", "pace" };
+static latency_hist stage_ns[STAGES];
+#define STATS_SAMPLE 64
+static unsigned int stats_tick=0;
+static long long stats_epoch=0;
+static pid_t stats_pid=0;
+static int stats_listen=-1;
+static volatile sig_atomic_t stats_pending=0;
+static volatile sig_atomic_t stats_signalled=0;
+static const char* stats_socket=NULL;
+
+/* where the events end up: a real uinput device, captured raw into a */
+/* file/pipe/memfd, or thrown away (handy for measuring translation)  */
+typedef enum { SINK_UINPUT, SINK_CAPTURE, SINK_NULL, SINK_REMOTE } sink_type;
+
+/* Remote wire protocol.  After an 8 byte hello each way ("FXCN", version, */
+/* 3 reserved), everything is a message: 8 byte header (type, 3 reserved, */
+/* 32bit payload length) then payload.  Events travel as 8 bytes apiece,  */
+/* type, code & value in network order, no timestamps.                    */
+#define WIRE_MAGIC "FXCN"
+#define WIRE_VERSION 1
+#define WIRE_HELLO_SIZE 8
+#define WIRE_HEADER_SIZE 8
+#define WIRE_EVENT_SIZE 8
+#define WIRE_MAX_PAYLOAD (EVBUF_MAX*WIRE_EVENT_SIZE)
+
+/* fauxcond jobs: text to type, or the path of a file to type, up to */
+/* this long.  Each one is answered with an ack (status, chars typed) */
+#define JOB_MAX_PAYLOAD (1024*1024)
+
+/* a remote gets this long to finish a message once it's started one */
+/* (or to say hello), and job clients this long between jobs, before  */
+/* they're dropped to let the next one in                             */
+#define WIRE_TIMEOUT_MS 10000
+
+/* message types */
+enum { MSG_EVENTS=1, MSG_BYE=2, MSG_STRING=3, MSG_FILE=4, MSG_ACK=5 };
+
+/* where fauxcond listens unless told otherwise */
+static const char* FAUXCOND_SOCKET="/run/fauxcond.sock";
+
+/* an output device, with its queue of events waiting to be written */
+typedef struct {
+    sink_type type;
+    int fd;
+    /* events waiting to be written, flushed in a single write() */
+    struct input_event evbuf[EVBUF_MAX];
+    int evbuf_count;
+    /* remote only: encoded message, and the ssh we started (if any) */
+    unsigned char wire[WIRE_HEADER_SIZE+WIRE_MAX_PAYLOAD];
+    pid_t child;
+    /* running totals, reported with -v */
+    unsigned long events;
+    unsigned long writes;
+    /* backpressure: deepest the queue got, and time spent waiting */
+    int depth_max;
+    unsigned long partials;
+    unsigned long stalls;
+    long long stall_ns;
+    /* optimizer (-O): modifiers held down between characters, and the */
+    /* frame being built - events since its SYN, keys pressed in it,   */
+    /* its number, which marks every key it touches, and its time      */
+    uint16_t held;
+    int frame_open;
+    int frame_presses;
+    unsigned int frame;
+    unsigned int touched[KEY_CNT];
+    struct timeval frame_tv;
+} sink;
+
+/* the one and only output, set up by open_sink() */
+static sink out={ SINK_NULL, -1, {{{0,0},0,0,0}}, 0, {0}, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, {0}, {0,0} };
+
+/* longest we'll wait for the output to take more events, in ms */
+static const int STALL_TIMEOUT=5000;
+
+/* set by SIGINT/SIGTERM/SIGHUP, sends stop at the next safe point */
+static volatile sig_atomic_t abort_requested=0;
+
+/* pacing schedule, all times in ns on CLOCK_MONOTONIC */
+typedef struct {
+    /* gap between characters (0 = flat out), after CR/LF (-1 = same) */
+    long long gap;
+    long long eol_gap;
+    /* characters allowed to go back to back */
+    int burst;
+    /* when the next character is due, and the earliest it may go */
+    long long tat;
+    long long floor;
+    /* how far we drifted from the schedule */
+    long long start;
+    unsigned long chars;
+    unsigned long late_count;
+    long long late_total;
+    long long late_max;
+} pacer;
+
+/* built from -c/-r/-p/-n once options are parsed */
+static pacer pace={ 0, -1, 1, 0, 0, 0, 0, 0, 0, 0 };
+
+/* Text senders hand runs of ASCII at least this long to queue_ascii(), */
+/* and never more than the most, so an abort still gets a look in       */
+#define BULK_MIN 16
+#define BULK_MAX 4096
+
+/* cleared to measure the byte at a time path (bench only) */
+static int bulk_enabled=1;
+
+/* Optimizer, -O: keys pressed per SYN frame, 0 when off.  Modifiers   */
+/* stay down across characters wanting the same ones, and are always  */
+/* let go before events are written, see opt_settle()                 */
+static int optimize_keys=0;
+
+/* typed bytes which can wait for their turn to be sent, when pacing */
+#define PENDING_MAX (64*1024)
+
+/* what woke up the interactive loop */
+enum { SRC_STDIN, SRC_SIGNAL, SRC_CONTROL, SRC_TIMER, SRC_MOUSE, SRC_MOTION };
+
+/* FIFO whose contents are typed alongside the keyboard, -F */
+static const char* control_fifo=NULL;
+
+/* Mouse, -m: "tty" for the terminal's mouse reports (xterm SGR), or a */
+/* local mouse (/dev/input/eventN) grabbed for as long as we run.      */
+/* Buttons go straight out, motion and wheel add up until the next    */
+/* report is due, at most one per interval (-M, reports/sec)          */
+static const char* mouse_source=NULL;
+static const int MOUSE_RATE_MAX=8000;
+static int mouse_rate=125;
+
+/* Raw mode, -g: a local input device, grabbed from everyone else, or */
+/* a file of events as capture: writes them.  Key, motion and sync    */
+/* events are forwarded untouched; both Ctrl keys held together give  */
+/* the device back.  Before grabbing, we wait this long (ms) for keys */
+/* still down (the Enter that started us) to come up locally.         */
+static const char* grab_source=NULL;
+static const int GRAB_SETTLE=2000;
+
+/* Recordings, --record/--replay: the events written to the output, 8   */
+/* bytes apiece (type, reserved, code, value) after a 16 byte header   */
+/* ("FXRC", version, 3 reserved, event count, 4 reserved).  Each       */
+/* SYN_REPORT carries the microseconds since the one before in place   */
+/* of its value, which is all the timing there is.  Native byte order. */
+#define RECORD_MAGIC "FXRC"
+#define RECORD_VERSION 1
+#define RECORD_HEADER_SIZE 16
+#define RECORD_BUFFER 512
+
+typedef struct {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t code;
+    int32_t value;
+} record_event;
+
+typedef struct {
+    int fd;
+    /* when the last frame went, events so far, and those not written */
+    long long last;
+    uint32_t count;
+    int used;
+    record_event buf[RECORD_BUFFER];
+} recorder;
+
+static recorder rec={ -1, 0, 0, 0, {{0,0,0,0}} };
+static const char* record_file=NULL;
+static const char* replay_file=NULL;
+
+/* playback speed, 2 is twice as fast, 0 as fast as it'll go */
+static double replay_speed=1.0;
+static const double REPLAY_SPEED_MAX=1000.0;
+
+/* terminal cells are coarse, each is worth this many pixels */
+static const int MOUSE_CELL_X=8;
+static const int MOUSE_CELL_Y=16;
+
+/* axes passed along, in the order they're reported */
+static const unsigned short mouse_axes[]={ REL_X, REL_Y, REL_WHEEL, REL_HWHEEL };
+
+typedef struct {
+    int fd;
+    /* motion not reported yet, by mouse_axes[], and when it can be */
+    int rel[4];
+    int moved;
+    long long due;
+    /* terminal only: cell the pointer was last seen in, 0 if never */
+    int col;
+    int row;
+    /* running totals, reported with -v */
+    unsigned long motions;
+    unsigned long reports;
+    unsigned long clicks;
+    /* the terminal's been asked for reports, and has to be told to stop */
+    int reporting;
+} mouse_state;
+static mouse_state mouse={ -1, {0,0,0,0}, 0, 0, 0, 0, 0, 0, 0, 0 };
 
 /* a nice enum to document what mode we want KB to end up */
 typedef enum { KBD_MODE_RAW, KBD_MODE_NORMAL } kbd_mode;
@@ -94,6 +366,73 @@ typedef struct {
 #define US 0x1000
 /* need to press CTRL for this key */
 #define UC 0x2000
+/* need to press ALTGR (right alt) for this key */
+#define UG 0x4000
+/* need to press ALT (left alt) for this key */
+#define UA 0x8000
+/* key part of a stroke, the rest is which modifiers to hold */
+#define STROKE_KEY 0x0fff
+
+/* most strokes one character takes: dead keys take two, compose three */
+#define LAYOUT_SEQ_MAX 4
+
+/* most events one stroke needs: 4 modifiers down, key down & up, 4 up, SYN */
+#define STROKE_EVENTS_MAX 11
+
+/* Compiled keyboard layout.  One flat, position independent block: this */
+/* header, then 'pages' pages of 256 entries, then the pool of strokes.  */
+/* pagemap[codepoint>>8] is the page number+1 (0, nothing there), and an */
+/* entry is stroke count<<24 | offset into the pool, 0 if unmapped.      */
+/* Written as is by --compile-keymap, so native byte order, and a wrong  */
+/* one shows up as a bad version.  The checksum covers pages onwards.    */
+#define LAYOUT_MAGIC "FXKM"
+#define LAYOUT_VERSION 1
+#define LAYOUT_CODEPOINTS 0x110000
+#define LAYOUT_PAGES (LAYOUT_CODEPOINTS>>8)
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    uint32_t checksum;
+    uint32_t pages;
+    uint32_t strokes;
+    char name[24];
+    uint16_t pagemap[LAYOUT_PAGES];
+} layout_header;
+
+/* compiled keymap used when no layout is asked for, if there is one */
+static const char* KEYMAP_DEFAULT="/etc/fauxcon.keymap";
+
+/* one character's strokes, while a layout is being put together */
+typedef struct {
+    uint32_t codepoint;
+    int count;
+    uint16_t strokes[LAYOUT_SEQ_MAX];
+} layout_def;
+
+/* a layout being put together, later definitions win */
+typedef struct {
+    char name[24];
+    layout_def* defs;
+    size_t count;
+    size_t alloc;
+} layout_source;
+
+/* deepest layouts may include one another */
+#define LAYOUT_INCLUDE_MAX 8
+
+/* most events one character needs */
+#define TEMPLATE_MAX (LAYOUT_SEQ_MAX*STROKE_EVENTS_MAX)
+
+/* characters whose events are kept ready to go, ASCII never collides */
+#define TEMPLATE_CACHE 256
+
+/* prebuilt event sequence for a single character */
+typedef struct {
+    uint32_t codepoint;
+    int count;
+    struct input_event events[TEMPLATE_MAX];
+} keytemplate;
 
 /* 1:1 lookup table.  128 entries, ASC('A')=65=KEY_A|US */
 static const short keycode[]=
@@ -116,6 +455,198 @@ static const short keycode[]=
     /*78 xyz{|}~. */ KEY_X,       KEY_Y,    KEY_Z,             KEY_LEFTBRACE|US, KEY_BACKSLASH|US, KEY_RIGHTBRACE|US, KEY_GRAVE|US, KEY_BACKSPACE
 };
 
+/* Key strokes (key | modifiers) which skip the layout altogether are  */
+/* cached as U+F0000+stroke, which no text can reach: planes 15 and 16 */
+/* are never typed.  Waiting to be typed, they're STROKE_TAG then the  */
+/* stroke, 3 bytes, and a 0xff typed in is taken as 0xf8 (just as bad  */
+/* UTF-8), so only the escape sequence decoder ever makes one.         */
+#define RAW_STROKE_BASE 0xf0000
+#define STROKE_TAG 0xff
+#define STROKE_TAG_SIZE 3
+
+/* Terminal escape sequences (xterm, VT220, linux console) are decoded  */
+/* as they're read, by a DFA: bytes fall into classes, and each [state] */
+/* [class] cell holds the next state<<4 | what to do with the byte.     */
+enum { VT_GROUND, VT_ESC, VT_CSI, VT_SS3, VT_LINUX, VT_X10, VT_STATES };
+enum { VC_OTHER, VC_ESC, VC_CSI, VC_SS3, VC_DIGIT, VC_SEMI, VC_PRIV, VC_FINAL, VC_HIGH, VC_CLASSES };
+enum { VA_TYPE, VA_START, VA_ALT, VA_INTRO, VA_DIGIT, VA_SEMI, VA_PRIV, VA_KEY, VA_ABORT, VA_SKIP };
+
+static const unsigned char vt_class[256]={
+    [0x1b]=VC_ESC,
+    [0x20 ... 0x2f]=VC_PRIV, [0x30 ... 0x39]=VC_DIGIT, [0x3a]=VC_PRIV, [0x3b]=VC_SEMI,
+    [0x3c ... 0x3f]=VC_PRIV, [0x40 ... 0x4e]=VC_FINAL, ['O']=VC_SS3, [0x50 ... 0x5a]=VC_FINAL,
+    ['[']=VC_CSI, [0x5c ... 0x7e]=VC_FINAL, [0x80 ... 0xff]=VC_HIGH,
+};
+
+#define VT(state,action) (((state)<<4)|(action))
+static const unsigned char vt_next[VT_STATES][VC_CLASSES]={
+    /*          OTHER                ESC                  CSI '['              SS3 'O'              DIGIT                SEMI                 PRIV                 FINAL                HIGH */
+    [VT_GROUND]={ VT(VT_GROUND,VA_TYPE),  VT(VT_ESC,VA_START),    VT(VT_GROUND,VA_TYPE),  VT(VT_GROUND,VA_TYPE),  VT(VT_GROUND,VA_TYPE),  VT(VT_GROUND,VA_TYPE),  VT(VT_GROUND,VA_TYPE),  VT(VT_GROUND,VA_TYPE),  VT(VT_GROUND,VA_TYPE)  },
+    [VT_ESC]=   { VT(VT_GROUND,VA_ALT),   VT(VT_GROUND,VA_ABORT), VT(VT_CSI,VA_INTRO),    VT(VT_SS3,VA_INTRO),    VT(VT_GROUND,VA_ALT),   VT(VT_GROUND,VA_ALT),   VT(VT_GROUND,VA_ALT),   VT(VT_GROUND,VA_ALT),   VT(VT_GROUND,VA_ABORT) },
+    [VT_CSI]=   { VT(VT_GROUND,VA_ABORT), VT(VT_GROUND,VA_ABORT), VT(VT_LINUX,VA_INTRO),  VT(VT_GROUND,VA_KEY),   VT(VT_CSI,VA_DIGIT),    VT(VT_CSI,VA_SEMI),     VT(VT_CSI,VA_PRIV),     VT(VT_GROUND,VA_KEY),   VT(VT_GROUND,VA_ABORT) },
+    [VT_SS3]=   { VT(VT_GROUND,VA_ABORT), VT(VT_GROUND,VA_ABORT), VT(VT_GROUND,VA_KEY),   VT(VT_GROUND,VA_KEY),   VT(VT_SS3,VA_DIGIT),    VT(VT_GROUND,VA_ABORT), VT(VT_GROUND,VA_ABORT), VT(VT_GROUND,VA_KEY),   VT(VT_GROUND,VA_ABORT) },
+    [VT_LINUX]= { VT(VT_GROUND,VA_ABORT), VT(VT_GROUND,VA_ABORT), VT(VT_GROUND,VA_KEY),   VT(VT_GROUND,VA_KEY),   VT(VT_GROUND,VA_ABORT), VT(VT_GROUND,VA_ABORT), VT(VT_GROUND,VA_ABORT), VT(VT_GROUND,VA_KEY),   VT(VT_GROUND,VA_ABORT) },
+    [VT_X10]=   { VT(VT_X10,VA_SKIP),     VT(VT_X10,VA_SKIP),     VT(VT_X10,VA_SKIP),     VT(VT_X10,VA_SKIP),     VT(VT_X10,VA_SKIP),     VT(VT_X10,VA_SKIP),     VT(VT_X10,VA_SKIP),     VT(VT_X10,VA_SKIP),     VT(VT_X10,VA_SKIP)     },
+};
+
+/* keys by final byte of CSI and SS3 sequences, and by number for CSI n ~. */
+/* SS3 M is keypad Enter, but CSI M starts an X10 mouse report, which has */
+/* three raw bytes after it to be swallowed.  Every key the decoder can   */
+/* come up with is in one of these tables, which vt_keys() claims.        */
+#define VT_X10_BYTES 3
+static const unsigned short vt_final[128]={
+    ['A']=KEY_UP, ['B']=KEY_DOWN, ['C']=KEY_RIGHT, ['D']=KEY_LEFT, ['E']=KEY_KP5,
+    ['H']=KEY_HOME, ['F']=KEY_END, ['P']=KEY_F1, ['Q']=KEY_F2, ['R']=KEY_F3, ['S']=KEY_F4,
+    ['Z']=KEY_TAB|US,
+};
+static const unsigned short vt_ss3_only[128]={
+    ['M']=KEY_KPENTER,
+};
+/* ESC [ [ A-E, the linux console's F1-F5 */
+static const unsigned short vt_linux[5]={ KEY_F1, KEY_F2, KEY_F3, KEY_F4, KEY_F5 };
+static const unsigned short vt_tilde[25]={
+    [1]=KEY_HOME, [2]=KEY_INSERT, [3]=KEY_DELETE, [4]=KEY_END, [5]=KEY_PAGEUP, [6]=KEY_PAGEDOWN,
+    [7]=KEY_HOME, [8]=KEY_END, [11]=KEY_F1, [12]=KEY_F2, [13]=KEY_F3, [14]=KEY_F4, [15]=KEY_F5,
+    [17]=KEY_F6, [18]=KEY_F7, [19]=KEY_F8, [20]=KEY_F9, [21]=KEY_F10, [23]=KEY_F11, [24]=KEY_F12,
+};
+
+/* longest a sequence may be, and how long after a lone ESC we give up */
+/* waiting for the rest (ms).  Terminals send sequences in one write.  */
+#define VT_HOLD_MAX 24
+static const int VT_TIMEOUT=50;
+
+/* where the decoder is up to, and the bytes it's holding on to */
+typedef struct {
+    int state;
+    int params[3];
+    int param_count;
+    int priv;
+    int skip;
+    int held_count;
+    char held[VT_HOLD_MAX];
+    long long deadline;
+} vt_decoder;
+
+/* every modifier there is, all let go of by release_keys() */
+static const unsigned short modifier_keys[]={
+    KEY_LEFTCTRL, KEY_RIGHTCTRL, KEY_LEFTSHIFT, KEY_RIGHTSHIFT,
+    KEY_LEFTALT, KEY_RIGHTALT, KEY_LEFTMETA, KEY_RIGHTMETA,
+};
+
+/* keys the device claims to have, marked by use_key() as tables are */
+/* built.  When passing along someone else's events, it's all of them */
+static unsigned char keybits[KEY_CNT/8+1];
+static int all_keys=0;
+
+/* longest to wait for a new device to be ready, in ms (0 = don't) */
+static int ready_wait=1000;
+
+/* Layouts we know without being told, written like a layout file:   */
+/* character (or U+hex), then the strokes which type it, modifiers    */
+/* joined on with '+'.  Dead keys and compose are just more strokes.  */
+/* 'us' is keycode[] above, which the others start from.              */
+static const char layout_de[]=
+    "# QWERTZ, y and z trade places\n"
+    "include us\n"
+    "y z\nY shift+z\nz y\nZ shift+y\nU+0019 ctrl+z\nU+001A ctrl+y\n"
+    "\" shift+2\n§ shift+3\n& shift+6\n/ shift+7\n( shift+8\n) shift+9\n= shift+0\n"
+    "ß minus\n? shift+minus\n\\ altgr+minus\n"
+    "² altgr+2\n³ altgr+3\n{ altgr+7\n[ altgr+8\n] altgr+9\n} altgr+0\n"
+    "@ altgr+q\n€ altgr+e\nµ altgr+m\n"
+    "ü leftbrace\nÜ shift+leftbrace\n+ rightbrace\n* shift+rightbrace\n~ altgr+rightbrace\n"
+    "ö semicolon\nÖ shift+semicolon\nä apostrophe\nÄ shift+apostrophe\n"
+    "U+0023 backslash\n' shift+backslash\n"
+    "< 102nd\n> shift+102nd\n| altgr+102nd\n"
+    "; shift+comma\n: shift+dot\n- slash\n_ shift+slash\n° shift+grave\n"
+    "# dead keys: circumflex on grave, acute and grave on equal\n"
+    "^ grave space\n´ equal space\n` shift+equal space\n"
+    "â grave a\nê grave e\nî grave i\nô grave o\nû grave u\n"
+    "Â grave shift+a\nÊ grave shift+e\nÎ grave shift+i\nÔ grave shift+o\nÛ grave shift+u\n"
+    "á equal a\né equal e\ní equal i\nó equal o\nú equal u\ný equal z\n"
+    "Á equal shift+a\nÉ equal shift+e\nÍ equal shift+i\nÓ equal shift+o\nÚ equal shift+u\nÝ equal shift+z\n"
+    "à shift+equal a\nè shift+equal e\nì shift+equal i\nò shift+equal o\nù shift+equal u\n"
+    "À shift+equal shift+a\nÈ shift+equal shift+e\nÌ shift+equal shift+i\nÒ shift+equal shift+o\nÙ shift+equal shift+u\n";
+
+static const char layout_uk[]=
+    "# ISO keyboard, \" and @ swapped, # by the enter key\n"
+    "include us\n"
+    "\" shift+2\n@ shift+apostrophe\n£ shift+3\n€ altgr+4\n"
+    "U+0023 backslash\n~ shift+backslash\n\\ 102nd\n| shift+102nd\n"
+    "¬ shift+grave\n¦ altgr+grave\n"
+    "é altgr+e\nú altgr+u\ní altgr+i\nó altgr+o\ná altgr+a\n"
+    "É altgr+shift+e\nÚ altgr+shift+u\nÍ altgr+shift+i\nÓ altgr+shift+o\nÁ altgr+shift+a\n";
+
+static const struct {
+    const char* name;
+    const char* text;
+} builtin_layouts[]={
+    { "us", NULL },
+    { "de", layout_de },
+    { "uk", layout_uk },
+};
+
+/* key names for layout files, the KEY_ names in lower case */
+static const struct {
+    const char* name;
+    unsigned short code;
+} keynames[]={
+    { "esc", KEY_ESC }, { "1", KEY_1 }, { "2", KEY_2 }, { "3", KEY_3 }, { "4", KEY_4 },
+    { "5", KEY_5 }, { "6", KEY_6 }, { "7", KEY_7 }, { "8", KEY_8 }, { "9", KEY_9 },
+    { "0", KEY_0 }, { "minus", KEY_MINUS }, { "equal", KEY_EQUAL }, { "backspace", KEY_BACKSPACE },
+    { "tab", KEY_TAB }, { "q", KEY_Q }, { "w", KEY_W }, { "e", KEY_E }, { "r", KEY_R },
+    { "t", KEY_T }, { "y", KEY_Y }, { "u", KEY_U }, { "i", KEY_I }, { "o", KEY_O },
+    { "p", KEY_P }, { "leftbrace", KEY_LEFTBRACE }, { "rightbrace", KEY_RIGHTBRACE },
+    { "enter", KEY_ENTER }, { "a", KEY_A }, { "s", KEY_S }, { "d", KEY_D }, { "f", KEY_F },
+    { "g", KEY_G }, { "h", KEY_H }, { "j", KEY_J }, { "k", KEY_K }, { "l", KEY_L },
+    { "semicolon", KEY_SEMICOLON }, { "apostrophe", KEY_APOSTROPHE }, { "grave", KEY_GRAVE },
+    { "backslash", KEY_BACKSLASH }, { "z", KEY_Z }, { "x", KEY_X }, { "c", KEY_C },
+    { "v", KEY_V }, { "b", KEY_B }, { "n", KEY_N }, { "m", KEY_M }, { "comma", KEY_COMMA },
+    { "dot", KEY_DOT }, { "slash", KEY_SLASH }, { "space", KEY_SPACE }, { "102nd", KEY_102ND },
+    { "ro", KEY_RO }, { "yen", KEY_YEN }, { "compose", KEY_COMPOSE },
+    { "kp0", KEY_KP0 }, { "kp1", KEY_KP1 }, { "kp2", KEY_KP2 }, { "kp3", KEY_KP3 },
+    { "kp4", KEY_KP4 }, { "kp5", KEY_KP5 }, { "kp6", KEY_KP6 }, { "kp7", KEY_KP7 },
+    { "kp8", KEY_KP8 }, { "kp9", KEY_KP9 }, { "kpdot", KEY_KPDOT }, { "kpplus", KEY_KPPLUS },
+    { "kpminus", KEY_KPMINUS }, { "kpasterisk", KEY_KPASTERISK }, { "kpslash", KEY_KPSLASH },
+    { "kpenter", KEY_KPENTER }, { "f1", KEY_F1 }, { "f2", KEY_F2 }, { "f3", KEY_F3 },
+    { "f4", KEY_F4 }, { "f5", KEY_F5 }, { "f6", KEY_F6 }, { "f7", KEY_F7 }, { "f8", KEY_F8 },
+    { "f9", KEY_F9 }, { "f10", KEY_F10 }, { "f11", KEY_F11 }, { "f12", KEY_F12 },
+    { "up", KEY_UP }, { "down", KEY_DOWN }, { "left", KEY_LEFT }, { "right", KEY_RIGHT },
+    { "home", KEY_HOME }, { "end", KEY_END }, { "pageup", KEY_PAGEUP }, { "pagedown", KEY_PAGEDOWN },
+    { "insert", KEY_INSERT }, { "delete", KEY_DELETE },
+};
+
+/* modifiers, in the order they go down */
+static const struct {
+    const char* name;
+    unsigned short flag;
+    unsigned short code;
+} stroke_mods[]={
+    { "ctrl", UC, KEY_LEFTCTRL }, { "shift", US, KEY_LEFTSHIFT },
+    { "altgr", UG, KEY_RIGHTALT }, { "alt", UA, KEY_LEFTALT },
+};
+
+/* the layout everything is typed through, see select_layout(), and */
+/* its size if it's a keymap file mapped in rather than built here   */
+static layout_header* layout=NULL;
+static size_t layout_mapped=0;
+
+/* Layout entries expanded into events, the first time each is typed.  */
+/* Indexed by codepoint%TEMPLATE_CACHE, count is 0 if nothing's there. */
+static keytemplate templates[TEMPLATE_CACHE];
+
+/* reverse lookups for the decoder: one stroke characters by  */
+/* [key][modifiers>>12], and everything needing more strokes.  */
+/* Only built once something needs decoding, see build_reverse */
+static int32_t keyrev[256][16];
+static uint32_t* multistroke=NULL;
+static size_t multistroke_count=0;
+static int reverse_built=0;
+
+/* UTF-8 sequence being put together by sendchar() */
+static uint32_t utf8_codepoint=0;
+static uint32_t utf8_min=0;
+static int utf8_pending=0;
+
 /* Do processing to set KB to raw or cooked mode. */
 /* Saves old state to restore later.              */
 static void set_keyboard(kbd_mode kmode)
@@ -153,271 +684,5602 @@ static void set_keyboard(kbd_mode kmode)
     }
 }
 
-/* send an event to uinput */
-static void send_event(unsigned short type, unsigned short code, unsigned short value)
+/* monotonic clock in nanoseconds, for pacing and stall timing */
+static long long now_ns(void)
 {
-    /* build structure and populate */
-    struct input_event event;
-    gettimeofday(&event.time, NULL);
-    event.type  = type;
-    event.code  = code;
-    event.value = value;
-
-    /* send the event */
-    ssize_t result=write(ufile, &event, sizeof(event));
-    if (result!=sizeof(event)) {
-        error(1, errno, "Error during event write");
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+/* which bucket a latency falls in */
+static int hist_bucket(long long ns)
+{
+    if (ns<16) {
+        return (ns<0)?0:(int)ns;
     }
+    int exp=63-__builtin_clzll((unsigned long long)ns);
+    return 16+(exp-4)*8+(int)((ns>>(exp-3))&7);
 }
 
-static void send_report_event(void)
+static void hist_add(latency_hist* hist, long long ns)
 {
-    /* build structure and populate */
-    struct input_event event;
-    gettimeofday(&event.time, NULL);
-    event.type  = EV_SYN;
-    event.code  = SYN_REPORT;
-    event.value = 0;
+    hist->buckets[hist_bucket(ns)]++;
+    hist->count++;
+    hist->total+=ns;
+    if (ns>hist->max) {
+        hist->max=ns;
+    }
+}
+
+static void hist_merge(latency_hist* into, const latency_hist* from)
+{
+    for (int i=0; i<HIST_BUCKETS; i++) {
+        into->buckets[i]+=from->buckets[i];
+    }
+    into->count+=from->count;
+    into->total+=from->total;
+    if (from->max>into->max) {
+        into->max=from->max;
+    }
+}
+
+/* the top of the bucket holding percentile pct, in ns */
+static long long hist_percentile(const latency_hist* hist, double pct)
+{
+    unsigned long want=(unsigned long)((double)hist->count*pct/100.0);
+    unsigned long seen=0;
+    for (int i=0; i<HIST_BUCKETS; i++) {
+        seen+=hist->buckets[i];
+        if ((seen>want)&&(seen)) {
+            long long top=i;
+            if (i>=16) {
+                int exp=(i-16)/8+4;
+                top=((8LL+(i-16)%8)<<(exp-3))+(1LL<<(exp-3))-1;
+            }
+            return (top<hist->max)?top:hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/* time since t0 goes to a stage */
+static void stage_add(int stage, long long t0)
+{
+    hist_add(&stage_ns[stage], now_ns()-t0);
+}
+
+/* write all of buffer to a blocking descriptor, -1 on failure */
+static int write_full(int fd, const void* buffer, size_t len)
+{
+    const char* ptr=buffer;
+    while (len) {
+        ssize_t result=write(fd, ptr, len);
+        if ((result<0)&&(errno==EINTR)) {
+            continue;
+        }
+        if (result<=0) {
+            return -1;
+        }
+        ptr+=result;
+        len-=(size_t)result;
+    }
+    return 0;
+}
+
+/* read exactly len bytes: 1 when done, 0 on EOF, -1 on error */
+static int read_full(int fd, void* buffer, size_t len)
+{
+    char* ptr=buffer;
+    while (len) {
+        ssize_t result=read(fd, ptr, len);
+        if ((result<0)&&(errno==EINTR)&&(!abort_requested)) {
+            continue;
+        }
+        if (result<0) {
+            return -1;
+        }
+        if (result==0) {
+            return 0;
+        }
+        ptr+=result;
+        len-=(size_t)result;
+    }
+    return 1;
+}
+
+/* output won't take any more right now, wait until it will. */
+/* Returns 0 when it's worth trying again, -1 if we gave up.  */
+static int wait_writable(sink* snk, int timeout)
+{
+    snk->stalls++;
+    long long start=now_ns();
+
+    struct pollfd pfd={ snk->fd, POLLOUT, 0 };
+    int result=poll(&pfd, 1, timeout);
+    snk->stall_ns+=now_ns()-start;
+
+    if (result==0) {
+        errno=ETIMEDOUT;
+        return -1;
+    }
+    if ((result<0)&&(errno!=EINTR)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* pack events into a wire protocol message in snk->wire, returns length */
+static size_t encode_events(sink* snk, const struct input_event* events, int count)
+{
+    unsigned char* msg=snk->wire;
+    uint32_t len=(uint32_t)count*WIRE_EVENT_SIZE;
+
+    msg[0]=MSG_EVENTS;
+    msg[1]=msg[2]=msg[3]=0;
+    uint32_t nlen=htonl(len);
+    memcpy(msg+4, &nlen, 4);
+
+    unsigned char* ptr=msg+WIRE_HEADER_SIZE;
+    for (int i=0; i<count; i++) {
+        uint16_t type=htons(events[i].type);
+        uint16_t code=htons(events[i].code);
+        uint32_t value=htonl((uint32_t)events[i].value);
+        memcpy(ptr, &type, 2);
+        memcpy(ptr+2, &code, 2);
+        memcpy(ptr+4, &value, 4);
+        ptr+=WIRE_EVENT_SIZE;
+    }
+    return WIRE_HEADER_SIZE+len;
+}
+
+/* get events out of the door in whatever form the sink wants, riding */
+/* out short writes and EAGAIN from non-blocking descriptors.  Never   */
+/* exits, returns -1 with errno set if the output has gone bad.       */
+static int send_raw(sink* snk, const struct input_event* events, int count, int timeout)
+{
+    if (snk->type==SINK_NULL) {
+        return 0;
+    }
+
+    const char* data=(const char*)events;
+    size_t len=(size_t)count*sizeof(events[0]);
+    if (snk->type==SINK_REMOTE) {
+        data=(const char*)snk->wire;
+        len=encode_events(snk, events, count);
+    }
+
+    size_t done=0;
+    while (done<len) {
+        ssize_t result=write(snk->fd, data+done, len-done);
+        if (result>0) {
+            done+=(size_t)result;
+            if (done<len) {
+                snk->partials++;
+            }
+        } else if ((result<0)&&(errno==EINTR)) {
+            continue;
+        } else if ((result<0)&&((errno==EAGAIN)||(errno==EWOULDBLOCK))) {
+            if (wait_writable(snk, timeout)) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* write out what the recorder's holding */
+static void record_drain(void)
+{
+    if ((rec.used)&&(write_full(rec.fd, rec.buf, (size_t)rec.used*sizeof(rec.buf[0])))) {
+        error(0, errno, "Unable to write recording, stopped");
+        close(rec.fd);
+        rec.fd=-1;
+    }
+    rec.used=0;
+}
+
+/* add events just written to the recording, the time since the last */
+/* frame going on the first SYN of this lot                          */
+static void record_events(const struct input_event* events, int count)
+{
+    if (rec.fd<0) {
+        return;
+    }
+    long long now=now_ns();
+    for (int i=0; i<count; i++) {
+        record_event* re=&rec.buf[rec.used++];
+        re->type=(uint8_t)events[i].type;
+        re->reserved=0;
+        re->code=events[i].code;
+        re->value=events[i].value;
+        if ((events[i].type==EV_SYN)&&(events[i].code==SYN_REPORT)) {
+            long long us=(now-rec.last)/1000;
+            re->value=(int32_t)((us>INT32_MAX)?INT32_MAX:us);
+            rec.last=now;
+        }
+        rec.count++;
+        if (rec.used==RECORD_BUFFER) {
+            record_drain();
+            if (rec.fd<0) {
+                return;
+            }
+        }
+    }
+}
+
+/* start recording, the clock starting now */
+static void record_open(const char* path)
+{
+    unsigned char header[RECORD_HEADER_SIZE]={ 'F', 'X', 'R', 'C', RECORD_VERSION };
+
+    rec.fd=open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if ((rec.fd<0)||(write_full(rec.fd, header, sizeof(header)))) {
+        error(EXIT_FAILURE, errno, "Unable to record to '%s'", path);
+        /* no return */
+    }
+    rec.last=now_ns();
+    rec.count=0;
+    rec.used=0;
+}
+
+/* finish the recording off, count and all */
+static void record_close(void)
+{
+    if (rec.fd<0) {
+        return;
+    }
+    record_drain();
+    if ((rec.fd>=0)&&(pwrite(rec.fd, &rec.count, sizeof(rec.count), 8)!=sizeof(rec.count))) {
+        error(0, errno, "Unable to finish recording");
+    }
+    if (rec.fd>=0) {
+        close(rec.fd);
+    }
+    rec.fd=-1;
+}
+
+/* io_uring backend, -u.  Writes to the main output are copied into one  */
+/* of URING_SLOTS registered buffers and handed to the kernel in batches, */
+/* so flat out there's one io_uring_enter() for every few writes, and a   */
+/* paced write waits in the kernel behind an absolute timeout linked      */
+/* ahead of it rather than in clock_nanosleep().  Stream reads are kept   */
+/* in flight alongside.  uinput can't be written without blocking, so    */
+/* those go to the kernel's io-wq, held to one worker to keep them in     */
+/* order; capture files get explicit offsets instead.  Needs 6.0 or so,  */
+/* anything less (or no io_uring at all) and it's plain write() as ever.  */
+#define URING_SLOTS 16
+#define URING_ENTRIES 64
+#define URING_READS 2
+#define URING_READ_SIZE (64*1024)
+enum { URING_WRITE=1, URING_READ, URING_PACE, URING_CANCEL, URING_PROBE };
+enum { URING_NOWAIT, URING_SLOT, URING_READ_DONE, URING_IDLE };
+typedef struct {
+    int fd;
+    /* the rings, shared with the kernel */
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* ring_map;
+    size_t ring_len;
+    size_t sqes_len;
+    unsigned queued;
+    /* registered buffers: event slots, then stream reads */
+    struct input_event (*slots)[EVBUF_MAX];
+    char* reads;
+    size_t buffers_len;
+    int slot_len[URING_SLOTS];
+    off_t slot_off[URING_SLOTS];
+    struct __kernel_timespec slot_due[URING_SLOTS];
+    int busy[URING_SLOTS];
+    int inflight;
+    /* capture file position, -1 for devices, and how much is written */
+    off_t offset;
+    off_t written;
+    /* when the next write is due (0 is now), and the latest handed over */
+    long long due;
+    long long last_due;
+    /* bulk senders hold submissions back until they've queued plenty */
+    int deferred;
+    int cancelling;
+    int read_done;
+    int read_len;
+    unsigned long enters;
+    unsigned long writes;
+    unsigned long reads_done;
+} uring_state;
+static uring_state uring={ .fd=-1, .offset=-1 };
+static int uring_requested=0;
+
+static int uring_enter(unsigned submit, unsigned wait, int timeout)
+{
+    struct __kernel_timespec ts={ timeout/1000, (timeout%1000)*1000000LL };
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout>=0) {
+        arg.ts=(uint64_t)(uintptr_t)&ts;
+    }
+    uring.enters++;
+    return (int)syscall(__NR_io_uring_enter, uring.fd, submit, wait,
+                        IORING_ENTER_EXT_ARG|(wait?IORING_ENTER_GETEVENTS:0), &arg, sizeof(arg));
+}
+
+/* next free submission entry, cleared.  Never more than 2 per slot plus */
+/* the reads and a cancel are queued, well short of URING_ENTRIES       */
+static struct io_uring_sqe* uring_sqe(void)
+{
+    unsigned tail=*uring.sq_tail;
+    unsigned index=tail&uring.sq_mask;
+    struct io_uring_sqe* sqe=&uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[index]=index;
+    __atomic_store_n(uring.sq_tail, tail+1, __ATOMIC_RELEASE);
+    uring.queued++;
+    return sqe;
+}
+
+/* take in whatever has finished */
+static void uring_reap(void)
+{
+    unsigned head=*uring.cq_head;
+    unsigned tail=__atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head!=tail; head++) {
+        const struct io_uring_cqe* cqe=&uring.cqes[head&uring.cq_mask];
+        int kind=(int)(cqe->user_data>>32);
+        int slot=(int)(cqe->user_data&0xffffffff);
+        if (kind==URING_WRITE) {
+            uring.busy[slot]=0;
+            uring.inflight--;
+            if (cqe->res==uring.slot_len[slot]) {
+                off_t end=uring.slot_off[slot]+cqe->res;
+                uring.written=(end>uring.written)?end:uring.written;
+            } else if (!uring.cancelling) {
+                /* no retrying, the next ones may already be out */
+                uring.cancelling=1;
+                if (cqe->res<0) {
+                    error(1, -cqe->res, "Error during event write");
+                }
+                error(1, 0, "Short event write, %d of %d bytes", cqe->res, uring.slot_len[slot]);
+            }
+        } else if (kind==URING_READ) {
+            uring.read_len=cqe->res;
+            uring.read_done=1;
+        }
+        /* pacing timeouts only show up when cancelled, as do cancels */
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* is there still something to wait for? */
+static int uring_waiting(int until)
+{
+    switch (until) {
+        case URING_SLOT:
+            return uring.inflight==URING_SLOTS;
+        case URING_READ_DONE:
+            return !uring.read_done;
+        case URING_IDLE:
+            return uring.inflight>0;
+        default:
+            return 0;
+    }
+}
+
+/* hand over everything queued, then wait until there's a free slot, */
+/* the read is in, or everything's done.  Gives up early on abort.   */
+static void uring_submit(int until)
+{
+    uring_reap();
+    while ((uring.queued)||(uring_waiting(until))) {
+        unsigned wait=0;
+        int timeout=-1;
+        if (uring_waiting(until)) {
+            long long ahead=uring.last_due-now_ns();
+            wait=1;
+            if ((until==URING_SLOT)&&(ahead<=0)) {
+                /* flat out: let half of them finish, so each enter does a batch */
+                wait=URING_SLOTS/2;
+            }
+            if (until!=URING_READ_DONE) {
+                /* writes due later are allowed to take that much longer */
+                timeout=STALL_TIMEOUT+((ahead>0)?(int)(ahead/1000000):0);
+            }
+        }
+        int rc=uring_enter(uring.queued, wait, timeout);
+        if (rc>=0) {
+            uring.queued-=((unsigned)rc<uring.queued)?(unsigned)rc:uring.queued;
+        } else if (errno==EINTR) {
+            if (abort_requested) {
+                return;
+            }
+        } else if (errno==ETIME) {
+            uring.cancelling=1;
+            error(1, 0, "Output stalled for %dms, giving up", timeout);
+        } else if ((errno!=EBUSY)&&(errno!=EAGAIN)) {
+            uring.cancelling=1;
+            error(1, errno, "Unable to submit to io_uring");
+        }
+        uring_reap();
+    }
+}
+
+/* queue the sink's events, due at uring.due (if set) */
+static void uring_write(sink* snk)
+{
+    if (uring.inflight==URING_SLOTS) {
+        uring_submit(URING_SLOT);
+        if (uring.inflight==URING_SLOTS) {
+            /* interrupted, and on our way out */
+            return;
+        }
+    }
+    int slot=0;
+    while (uring.busy[slot]) {
+        slot++;
+    }
+
+    int len=snk->evbuf_count*(int)sizeof(snk->evbuf[0]);
+    memcpy(uring.slots[slot], snk->evbuf, (size_t)len);
+    uring.slot_len[slot]=len;
+    uring.slot_off[slot]=uring.offset;
+    uring.busy[slot]=1;
+    uring.inflight++;
+
+    struct io_uring_sqe* sqe;
+    if (uring.due) {
+        /* the write is linked behind a timeout, and goes when it fires */
+        uring.slot_due[slot].tv_sec=uring.due/1000000000LL;
+        uring.slot_due[slot].tv_nsec=uring.due%1000000000LL;
+        sqe=uring_sqe();
+        sqe->opcode=IORING_OP_TIMEOUT;
+        sqe->flags=IOSQE_IO_LINK|IOSQE_CQE_SKIP_SUCCESS;
+        sqe->addr=(uint64_t)(uintptr_t)&uring.slot_due[slot];
+        sqe->len=1;
+        sqe->timeout_flags=IORING_TIMEOUT_ABS|IORING_TIMEOUT_ETIME_SUCCESS;
+        sqe->user_data=((uint64_t)URING_PACE<<32)|(uint64_t)slot;
+        uring.last_due=uring.due;
+        uring.due=0;
+    }
+    sqe=uring_sqe();
+    sqe->opcode=IORING_OP_WRITE_FIXED;
+    sqe->fd=snk->fd;
+    sqe->addr=(uint64_t)(uintptr_t)uring.slots[slot];
+    sqe->len=(unsigned)len;
+    sqe->off=(uring.offset<0)?(uint64_t)-1:(uint64_t)uring.offset;
+    sqe->buf_index=(uint16_t)slot;
+    sqe->user_data=((uint64_t)URING_WRITE<<32)|(uint64_t)slot;
+    if (uring.offset>=0) {
+        uring.offset+=len;
+    }
+    uring.writes++;
+
+    if (!uring.deferred) {
+        uring_submit(URING_NOWAIT);
+    }
+}
+
+/* start reading the next chunk of a stream into read buffer buf */
+static void uring_read(int fd, int buf)
+{
+    struct io_uring_sqe* sqe=uring_sqe();
+    sqe->opcode=IORING_OP_READ_FIXED;
+    sqe->fd=fd;
+    sqe->addr=(uint64_t)(uintptr_t)(uring.reads+(size_t)buf*URING_READ_SIZE);
+    sqe->len=URING_READ_SIZE;
+    sqe->off=(uint64_t)-1;
+    sqe->buf_index=(uint16_t)(URING_SLOTS+buf);
+    sqe->user_data=(uint64_t)URING_READ<<32;
+    uring.read_done=0;
+}
+
+/* call off everything not yet done, timed writes included */
+static void uring_cancel(void)
+{
+    uring.cancelling=1;
+    struct io_uring_sqe* sqe=uring_sqe();
+    sqe->opcode=IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags=IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data=(uint64_t)URING_CANCEL<<32;
+    uring_enter(uring.queued, 0, -1);
+    uring.queued=0;
+    /* anything already under way can't be stopped, wait (a bit) for it */
+    for (int i=0; (i<10)&&(uring.inflight>0); i++) {
+        uring_enter(0, 1, 100);
+        uring_reap();
+    }
+}
+
+/* Before anything else writes to the output: see everything handed */
+/* over written (or on abort, called off), and put a capture file's */
+/* position where the writes left it.                                */
+static void uring_finish(void)
+{
+    if (uring.fd<0) {
+        return;
+    }
+    if ((abort_requested)||(uring.cancelling)) {
+        uring_cancel();
+    } else {
+        uring_submit(URING_IDLE);
+    }
+    if (uring.offset>=0) {
+        lseek(out.fd, uring.written, SEEK_SET);
+        uring.offset=uring.written;
+    }
+}
+
+static void uring_close(void)
+{
+    if (uring.slots) {
+        munmap(uring.slots, uring.buffers_len);
+    }
+    if (uring.sqes) {
+        munmap(uring.sqes, uring.sqes_len);
+    }
+    if (uring.ring_map) {
+        munmap(uring.ring_map, uring.ring_len);
+    }
+    if (uring.fd>=0) {
+        close(uring.fd);
+    }
+    uring.fd=-1;
+}
+
+/* on the way out, never leave timed writes to go off after we've let go */
+static void uring_exit(void)
+{
+    if (uring.fd>=0) {
+        uring_cancel();
+        if ((uring.offset>=0)&&(out.fd>=0)) {
+            lseek(out.fd, uring.written, SEEK_SET);
+        }
+        uring_close();
+    }
+}
+
+/* set the ring up, NULL when it's ready, else why not */
+static const char* uring_setup(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    uring.fd=(int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring.fd<0) {
+        return strerror(errno);
+    }
+    const unsigned need=IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP|IORING_FEAT_EXT_ARG|IORING_FEAT_CQE_SKIP;
+    if ((params.features&need)!=need) {
+        return "kernel too old";
+    }
+
+    size_t sq_len=params.sq_off.array+params.sq_entries*sizeof(unsigned);
+    size_t cq_len=params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+    uring.ring_len=(sq_len>cq_len)?sq_len:cq_len;
+    uring.ring_map=mmap(NULL, uring.ring_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    uring.sqes_len=params.sq_entries*sizeof(struct io_uring_sqe);
+    uring.sqes=mmap(NULL, uring.sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if ((uring.ring_map==MAP_FAILED)||(uring.sqes==MAP_FAILED)) {
+        uring.ring_map=(uring.ring_map==MAP_FAILED)?NULL:uring.ring_map;
+        uring.sqes=(uring.sqes==MAP_FAILED)?NULL:uring.sqes;
+        return strerror(errno);
+    }
+    char* map=uring.ring_map;
+    uring.sq_head=(unsigned*)(map+params.sq_off.head);
+    uring.sq_tail=(unsigned*)(map+params.sq_off.tail);
+    uring.sq_array=(unsigned*)(map+params.sq_off.array);
+    uring.sq_mask=*(unsigned*)(map+params.sq_off.ring_mask);
+    uring.sq_entries=params.sq_entries;
+    uring.cq_head=(unsigned*)(map+params.cq_off.head);
+    uring.cq_tail=(unsigned*)(map+params.cq_off.tail);
+    uring.cq_mask=*(unsigned*)(map+params.cq_off.ring_mask);
+    uring.cqes=(struct io_uring_cqe*)(map+params.cq_off.cqes);
+
+    /* the kernel pins these once, rather than on every write */
+    uring.buffers_len=URING_SLOTS*sizeof(uring.slots[0])+URING_READS*URING_READ_SIZE;
+    void* buffers=mmap(NULL, uring.buffers_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (buffers==MAP_FAILED) {
+        return strerror(errno);
+    }
+    uring.slots=buffers;
+    uring.reads=(char*)buffers+URING_SLOTS*sizeof(uring.slots[0]);
+    struct iovec iov[URING_SLOTS+URING_READS];
+    for (int i=0; i<URING_SLOTS; i++) {
+        iov[i].iov_base=uring.slots[i];
+        iov[i].iov_len=sizeof(uring.slots[0]);
+    }
+    for (int i=0; i<URING_READS; i++) {
+        iov[URING_SLOTS+i].iov_base=uring.reads+(size_t)i*URING_READ_SIZE;
+        iov[URING_SLOTS+i].iov_len=URING_READ_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, iov, URING_SLOTS+URING_READS)) {
+        return strerror(errno);
+    }
+
+    /* one worker, so whatever it's handed is written in order */
+    unsigned workers[2]={ 1, 1 };
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_IOWQ_MAX_WORKERS, workers, 2)) {
+        return "kernel too old";
+    }
 
-    ssize_t result=write(ufile, &event, sizeof(event));
-    if (result!=sizeof(event)) {
-        error(1, errno, "Error during event sync");
+    /* can a timeout firing carry on down its link? (6.0 onwards) */
+    struct __kernel_timespec now={ 0, 0 };
+    struct io_uring_sqe* sqe=uring_sqe();
+    sqe->opcode=IORING_OP_TIMEOUT;
+    sqe->addr=(uint64_t)(uintptr_t)&now;
+    sqe->len=1;
+    sqe->timeout_flags=IORING_TIMEOUT_ETIME_SUCCESS;
+    sqe->user_data=(uint64_t)URING_PROBE<<32;
+    if (uring_enter(1, 1, 1000)!=1) {
+        return strerror(errno);
+    }
+    uring.queued=0;
+    unsigned head=*uring.cq_head;
+    int probe=(head!=__atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))?uring.cqes[head&uring.cq_mask].res:-EINVAL;
+    __atomic_store_n(uring.cq_head, head+1, __ATOMIC_RELEASE);
+    if (probe!=-ETIME) {
+        return "kernel too old";
     }
+    uring.enters=0;
+    return NULL;
 }
 
-/* convert an ASCII character given into a useful scancode for uinput */
-static void sendchar(int any_key)
-{
-    /* parse key, grabbing SHIFT & CTRL requirements */
-    int need_shift=keycode[any_key]&US;
-    int need_ctrl=keycode[any_key]&UC;
-    unsigned short key=keycode[any_key]&(0xfff);
+/* switch the main output over to io_uring, if it (and the kernel) can */
+static void uring_open(sink* snk)
+{
+    struct stat st;
+    const char* why=NULL;
+    if (record_file) {
+        why="not while recording";
+    } else if ((snk->type!=SINK_UINPUT)&&(snk->type!=SINK_CAPTURE)) {
+        why="output isn't uinput or a file";
+    } else if ((fstat(snk->fd, &st))||((snk->type==SINK_CAPTURE)&&(!S_ISREG(st.st_mode)))||
+               (fcntl(snk->fd, F_GETFL)&O_APPEND)) {
+        /* pipes and sockets could have writes overtake one another */
+        why="output isn't uinput or a file";
+    } else {
+        why=uring_setup();
+    }
+    if (why) {
+        uring_close();
+        if (verbose_mode) {
+            fprintf(stderr, "io_uring: %s, using plain writes\n", why);
+        }
+        return;
+    }
+    if (snk->type==SINK_CAPTURE) {
+        uring.offset=lseek(snk->fd, 0, SEEK_CUR);
+        uring.written=uring.offset;
+    }
+    atexit(uring_exit);
+}
+
+static void opt_settle(sink* snk);
+static void stats_service(void);
+
+/* write all queued events to the sink in one go */
+static void flush_events(sink* snk)
+{
+    if (snk->evbuf_count==0) {
+        return;
+    }
+    /* never leave anything held once it's gone, the next write may be */
+    /* a while coming (or never, if we're about to give up)            */
+    opt_settle(snk);
+    if (snk->evbuf_count>snk->depth_max) {
+        snk->depth_max=snk->evbuf_count;
+    }
+
+    long long t0=((snk==&out)&&((snk->writes%STATS_SAMPLE)==0))?now_ns():0;
+    if ((snk==&out)&&(uring.fd>=0)) {
+        uring_write(snk);
+    } else if (send_raw(snk, snk->evbuf, snk->evbuf_count, STALL_TIMEOUT)) {
+        /* whatever's queued is stale now, don't try it again on the way out */
+        snk->evbuf_count=0;
+        if (errno==ETIMEDOUT) {
+            error(1, 0, "Output stalled for %dms, giving up", STALL_TIMEOUT);
+        }
+        error(1, errno, "Error during event write");
+    }
+    if (t0) {
+        stage_add(STAGE_WRITE, t0);
+    }
+    if ((stats_pending)&&(snk==&out)) {
+        stats_service();
+    }
+    snk->writes++;
+    record_events(snk->evbuf, snk->evbuf_count);
+    snk->evbuf_count=0;
+}
+
+/* let go of every modifier, so nothing is left held down on the far  */
+/* side.  Releasing a key which isn't down is harmless, the input core */
+/* drops it.  Best effort only, this also runs on the way out.         */
+static void release_keys(sink* snk)
+{
+    const int count=sizeof(modifier_keys)/sizeof(modifier_keys[0]);
+    struct input_event events[sizeof(modifier_keys)/sizeof(modifier_keys[0])+1];
+
+    if ((snk->type==SINK_NULL)||(snk->fd<0)) {
+        return;
+    }
+
+    memset(events, 0, sizeof(events));
+    for (int i=0; i<count; i++) {
+        events[i].type=EV_KEY;
+        events[i].code=modifier_keys[i];
+        events[i].value=0;
+    }
+    events[count].type=EV_SYN;
+    events[count].code=SYN_REPORT;
+
+    /* short timeout, we may be on the way out because output is stuck */
+    send_raw(snk, events, count+1, 100);
+}
+
+/* on any exit, leave the console without a stuck modifier */
+static void emergency_release(void)
+{
+    release_keys(&out);
+}
+
+/* note the request to stop, acted on at the next character */
+static void abort_handler(int sig)
+{
+    (void)sig;
+    abort_requested=1;
+}
+
+/* append a prepared SYN frame to the queue, stamping it per policy */
+static void queue_frame(sink* snk, const struct input_event* events, int count)
+{
+    if (snk->evbuf_count+count>EVBUF_MAX) {
+        flush_events(snk);
+    }
+
+    struct input_event* dest=&snk->evbuf[snk->evbuf_count];
+    memcpy(dest, events, (size_t)count*sizeof(events[0]));
+
+    /* one clock read covers the whole frame */
+    if (timestamp_policy==TS_FRAME) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        for (int i=0; i<count; i++) {
+            dest[i].time=tv;
+        }
+    }
+
+    snk->evbuf_count+=count;
+    snk->events+=(unsigned long)count;
+
+    /* end of a keystroke, write out the batch if it's big enough */
+    if (snk->evbuf_count>=batch_events) {
+        flush_events(snk);
+    }
+}
+
+/* note that the device needs to have this key */
+static void use_key(unsigned int code)
+{
+    if (code<KEY_CNT) {
+        keybits[code/8]|=(unsigned char)(1<<(code%8));
+    }
+}
+
+/* entry for a codepoint in a compiled layout, 0 if it can't be typed */
+static uint32_t layout_entry(const layout_header* lay, uint32_t codepoint)
+{
+    if (codepoint>=LAYOUT_CODEPOINTS) {
+        return 0;
+    }
+    unsigned int page=lay->pagemap[codepoint>>8];
+    if (page==0) {
+        return 0;
+    }
+    const uint32_t* entries=(const uint32_t*)(lay+1);
+    return entries[(page-1)*256+(codepoint&0xff)];
+}
+
+/* the strokes a layout entry points at */
+static const uint16_t* layout_strokes(const layout_header* lay, uint32_t entry)
+{
+    const uint16_t* pool=(const uint16_t*)((const uint32_t*)(lay+1)+lay->pages*256);
+    return pool+(entry&0xffffff);
+}
+
+/* fill in one event, timestamp left for queue_frame() */
+static void put_event(struct input_event* event, unsigned short type, unsigned short code, int value)
+{
+    event->time.tv_sec=0;
+    event->time.tv_usec=0;
+    event->type=type;
+    event->code=code;
+    event->value=value;
+}
+
+/* turn key strokes into events, a SYN frame apiece, returns how many */
+/* events (never more than count*STROKE_EVENTS_MAX)                   */
+static int expand_strokes(const uint16_t* strokes, int count, struct input_event* events)
+{
+    int num=0;
+
+    for (int i=0; i<count; i++) {
+        unsigned short stroke=strokes[i];
+
+        /* most strokes are a bare key */
+        if ((stroke&~STROKE_KEY)==0) {
+            put_event(&events[num++], EV_KEY, stroke, 1);
+            put_event(&events[num++], EV_KEY, stroke, 0);
+            put_event(&events[num++], EV_SYN, SYN_REPORT, 0);
+            continue;
+        }
+
+        /* if modifiers needed, hold them down, in stroke_mods[] order */
+        if (stroke&UC) {
+            put_event(&events[num++], EV_KEY, KEY_LEFTCTRL, 1);
+        }
+        if (stroke&US) {
+            put_event(&events[num++], EV_KEY, KEY_LEFTSHIFT, 1);
+        }
+        if (stroke&UG) {
+            put_event(&events[num++], EV_KEY, KEY_RIGHTALT, 1);
+        }
+        if (stroke&UA) {
+            put_event(&events[num++], EV_KEY, KEY_LEFTALT, 1);
+        }
+
+        /* press and release key */
+        put_event(&events[num++], EV_KEY, stroke&STROKE_KEY, 1);
+        put_event(&events[num++], EV_KEY, stroke&STROKE_KEY, 0);
+
+        /* now release the modifiers */
+        if (stroke&UA) {
+            put_event(&events[num++], EV_KEY, KEY_LEFTALT, 0);
+        }
+        if (stroke&UG) {
+            put_event(&events[num++], EV_KEY, KEY_RIGHTALT, 0);
+        }
+        if (stroke&US) {
+            put_event(&events[num++], EV_KEY, KEY_LEFTSHIFT, 0);
+        }
+        if (stroke&UC) {
+            put_event(&events[num++], EV_KEY, KEY_LEFTCTRL, 0);
+        }
+        put_event(&events[num++], EV_SYN, SYN_REPORT, 0);
+    }
+    return num;
+}
+
+/* Optimizer.  Instead of every character going down and back up on   */
+/* its own, as the templates have it, strokes are fed through here one */
+/* at a time: modifiers already held for the last character stay held */
+/* if this one wants them too, and up to optimize_keys presses share a */
+/* SYN frame.  A frame never touches the same key twice after pressing */
+/* it, so a repeated letter or a modifier let go and pressed again     */
+/* starts a new one, and each frame reads the same as it would have    */
+/* done one event at a time.                                           */
+
+/* one event into the frame being built */
+static void opt_event(sink* snk, unsigned short type, unsigned short code, int value)
+{
+    struct input_event* event=&snk->evbuf[snk->evbuf_count++];
+    put_event(event, type, code, value);
+
+    /* one clock read covers the whole frame */
+    if (timestamp_policy==TS_FRAME) {
+        if (snk->frame_open==0) {
+            gettimeofday(&snk->frame_tv, NULL);
+        }
+        event->time=snk->frame_tv;
+    }
+    snk->frame_open++;
+    snk->events++;
+}
+
+/* close the frame being built, if there is one */
+static void opt_sync(sink* snk)
+{
+    if (snk->frame_open) {
+        opt_event(snk, EV_SYN, SYN_REPORT, 0);
+    }
+    snk->frame_open=0;
+    snk->frame_presses=0;
+
+    /* a new number unmarks every key, start over if it wraps */
+    if (++snk->frame==0) {
+        memset(snk->touched, 0, sizeof(snk->touched));
+        snk->frame=1;
+    }
+}
+
+/* move a key, first starting a new frame if this one's touched it */
+static void opt_key(sink* snk, unsigned short code, int value)
+{
+    code&=KEY_MAX;
+    if ((value)&&(snk->touched[code]==snk->frame)) {
+        opt_sync(snk);
+    }
+    snk->touched[code]=snk->frame;
+    opt_event(snk, EV_KEY, code, value);
+}
+
+/* hold down exactly the modifiers wanted: let go of the rest first, */
+/* in the reverse of stroke_mods[] order, then press what's missing  */
+static void opt_mods(sink* snk, uint16_t want)
+{
+    /* the usual case, nothing to change */
+    if (snk->held==want) {
+        return;
+    }
+
+    int count=(int)(sizeof(stroke_mods)/sizeof(stroke_mods[0]));
+    for (int m=count-1; m>=0; m--) {
+        if ((snk->held&stroke_mods[m].flag)&&(!(want&stroke_mods[m].flag))) {
+            opt_key(snk, stroke_mods[m].code, 0);
+            snk->held&=(uint16_t)~stroke_mods[m].flag;
+        }
+    }
+    for (int m=0; m<count; m++) {
+        if ((want&stroke_mods[m].flag)&&(!(snk->held&stroke_mods[m].flag))) {
+            opt_key(snk, stroke_mods[m].code, 1);
+            snk->held|=stroke_mods[m].flag;
+        }
+    }
+}
+
+/* type one stroke through the optimizer */
+static void opt_stroke(sink* snk, uint16_t stroke)
+{
+    /* room for it and for settling afterwards, whatever happens */
+    if (snk->evbuf_count+OPT_STROKE_EVENTS>EVBUF_MAX) {
+        flush_events(snk);
+    }
+    if (snk->frame_presses>=optimize_keys) {
+        opt_sync(snk);
+    }
+
+    opt_mods(snk, stroke&(uint16_t)~STROKE_KEY);
+    opt_key(snk, stroke&STROKE_KEY, 1);
+    opt_key(snk, stroke&STROKE_KEY, 0);
+    snk->frame_presses++;
+}
+
+/* let go of everything and close the frame, so the device is left */
+/* idle - before every write, and so at the end or giving up       */
+static void opt_settle(sink* snk)
+{
+    opt_mods(snk, 0);
+    opt_sync(snk);
+}
+
+/* read one UTF-8 character from text, returns bytes used or -1 */
+static int utf8_decode(const char* text, uint32_t* codepoint)
+{
+    const unsigned char* bytes=(const unsigned char*)text;
+    int need;
+    uint32_t min;
+
+    if (bytes[0]<0x80) {
+        *codepoint=bytes[0];
+        return 1;
+    } else if ((bytes[0]&0xe0)==0xc0) {
+        need=1;
+        min=0x80;
+        *codepoint=bytes[0]&0x1f;
+    } else if ((bytes[0]&0xf0)==0xe0) {
+        need=2;
+        min=0x800;
+        *codepoint=bytes[0]&0x0f;
+    } else if ((bytes[0]&0xf8)==0xf0) {
+        need=3;
+        min=0x10000;
+        *codepoint=bytes[0]&0x07;
+    } else {
+        return -1;
+    }
+
+    for (int i=1; i<=need; i++) {
+        if ((bytes[i]&0xc0)!=0x80) {
+            return -1;
+        }
+        *codepoint=(*codepoint<<6)|(bytes[i]&0x3f);
+    }
+    /* overlong, surrogate, or past the end of unicode */
+    if ((*codepoint<min)||((*codepoint>=0xd800)&&(*codepoint<=0xdfff))||(*codepoint>=LAYOUT_CODEPOINTS)) {
+        return -1;
+    }
+    return need+1;
+}
+
+/* codepoint into UTF-8, returns bytes used (4 at most) */
+static int utf8_encode(uint32_t codepoint, char* buffer)
+{
+    unsigned char* bytes=(unsigned char*)buffer;
+
+    if (codepoint<0x80) {
+        bytes[0]=(unsigned char)codepoint;
+        return 1;
+    } else if (codepoint<0x800) {
+        bytes[0]=(unsigned char)(0xc0|(codepoint>>6));
+        bytes[1]=(unsigned char)(0x80|(codepoint&0x3f));
+        return 2;
+    } else if (codepoint<0x10000) {
+        bytes[0]=(unsigned char)(0xe0|(codepoint>>12));
+        bytes[1]=(unsigned char)(0x80|((codepoint>>6)&0x3f));
+        bytes[2]=(unsigned char)(0x80|(codepoint&0x3f));
+        return 3;
+    }
+    bytes[0]=(unsigned char)(0xf0|(codepoint>>18));
+    bytes[1]=(unsigned char)(0x80|((codepoint>>12)&0x3f));
+    bytes[2]=(unsigned char)(0x80|((codepoint>>6)&0x3f));
+    bytes[3]=(unsigned char)(0x80|(codepoint&0x3f));
+    return 4;
+}
+
+/* write a codepoint to stdout as UTF-8 */
+static void put_utf8(uint32_t codepoint)
+{
+    char buffer[4];
+    fwrite(buffer,1,(size_t)utf8_encode(codepoint,buffer),stdout);
+}
+
+/* add a character to a layout being put together */
+static void layout_add(layout_source* src, uint32_t codepoint, const uint16_t* strokes, int count)
+{
+    if (src->count==src->alloc) {
+        src->alloc=src->alloc?src->alloc*2:256;
+        src->defs=realloc(src->defs,src->alloc*sizeof(src->defs[0]));
+        if (src->defs==NULL) {
+            error(EXIT_FAILURE,errno,"Unable to build layout");
+            /* no return */
+        }
+    }
+    layout_def* def=&src->defs[src->count++];
+    def->codepoint=codepoint;
+    def->count=count;
+    memcpy(def->strokes,strokes,(size_t)count*sizeof(strokes[0]));
+}
+
+/* 'altgr+shift+e' into a stroke, 0 if it makes no sense */
+static uint16_t parse_stroke(char* word)
+{
+    uint16_t stroke=0;
+    char* plus;
+
+    /* modifiers first, each ending in '+' */
+    while ((plus=strchr(word,'+'))!=NULL) {
+        *plus=0;
+        unsigned int m;
+        for (m=0; m<sizeof(stroke_mods)/sizeof(stroke_mods[0]); m++) {
+            if (strcmp(word,stroke_mods[m].name)==0) {
+                stroke|=stroke_mods[m].flag;
+                break;
+            }
+        }
+        if (m==sizeof(stroke_mods)/sizeof(stroke_mods[0])) {
+            return 0;
+        }
+        word=plus+1;
+    }
+
+    for (unsigned int k=0; k<sizeof(keynames)/sizeof(keynames[0]); k++) {
+        if (strcmp(word,keynames[k].name)==0) {
+            return stroke|keynames[k].code;
+        }
+    }
+    return 0;
+}
+
+static void load_layout_source(layout_source* src, const char* name, int depth);
+
+/* add the definitions in a layout file's text to src */
+static void parse_layout(layout_source* src, const char* text, const char* origin, int depth)
+{
+    int lineno=0;
+
+    while (*text) {
+        /* one line at a time */
+        const char* eol=strchr(text,'\n');
+        size_t len=eol?(size_t)(eol-text):strlen(text);
+        char line[256];
+        lineno++;
+        if (len>=sizeof(line)) {
+            error(EXIT_FAILURE,0,"%s:%d: line too long",origin,lineno);
+            /* no return */
+        }
+        memcpy(line,text,len);
+        line[len]=0;
+        text+=len+(eol?1:0);
+
+        char* save=NULL;
+        char* word=strtok_r(line," \t\r",&save);
+        if ((word==NULL)||(word[0]=='#')) {
+            continue;
+        }
+
+        /* directives */
+        if ((strcmp(word,"name")==0)||(strcmp(word,"include")==0)) {
+            char* arg=strtok_r(NULL," \t\r",&save);
+            if (arg==NULL) {
+                error(EXIT_FAILURE,0,"%s:%d: %s of what?",origin,lineno,word);
+                /* no return */
+            }
+            if (word[0]=='n') {
+                /* only the layout asked for gets to name itself */
+                if (depth==0) {
+                    snprintf(src->name,sizeof(src->name),"%s",arg);
+                }
+            } else {
+                if (depth>=LAYOUT_INCLUDE_MAX) {
+                    error(EXIT_FAILURE,0,"%s:%d: includes nested too deep",origin,lineno);
+                    /* no return */
+                }
+                load_layout_source(src,arg,depth+1);
+            }
+            continue;
+        }
+
+        /* character, as itself or U+hex */
+        uint32_t codepoint;
+        int used=0;
+        if (((word[0]=='U')||(word[0]=='u'))&&(word[1]=='+')&&(word[2])) {
+            char* endptr=NULL;
+            codepoint=(uint32_t)strtoul(word+2,&endptr,16);
+            used=(*endptr||(codepoint>=LAYOUT_CODEPOINTS))?-1:(int)strlen(word);
+        } else {
+            used=utf8_decode(word,&codepoint);
+        }
+        if ((used<0)||(word[used])) {
+            error(EXIT_FAILURE,0,"%s:%d: '%s' isn't one character",origin,lineno,word);
+            /* no return */
+        }
+
+        /* then the strokes which type it, or 'none' if nothing does */
+        uint16_t strokes[LAYOUT_SEQ_MAX];
+        int count=0;
+        int none=0;
+        while ((word=strtok_r(NULL," \t\r",&save))!=NULL) {
+            if (strcmp(word,"none")==0) {
+                none=1;
+                continue;
+            }
+            if (count==LAYOUT_SEQ_MAX) {
+                error(EXIT_FAILURE,0,"%s:%d: more than %d strokes",origin,lineno,LAYOUT_SEQ_MAX);
+                /* no return */
+            }
+            char* key=word;
+            if ((strokes[count++]=parse_stroke(word))==0) {
+                error(EXIT_FAILURE,0,"%s:%d: unknown key '%s'",origin,lineno,key);
+                /* no return */
+            }
+        }
+        if ((count==0)&&(!none)) {
+            error(EXIT_FAILURE,0,"%s:%d: no keys for U+%04X",origin,lineno,codepoint);
+            /* no return */
+        }
+        layout_add(src,codepoint,strokes,none?0:count);
+    }
+}
+
+/* add a layout, built-in or from a file, to src */
+static void load_layout_source(layout_source* src, const char* name, int depth)
+{
+    if ((depth==0)&&(src->name[0]==0)) {
+        snprintf(src->name,sizeof(src->name),"%s",basename(name));
+    }
+
+    for (unsigned int i=0; i<sizeof(builtin_layouts)/sizeof(builtin_layouts[0]); i++) {
+        if (strcmp(name,builtin_layouts[i].name)) {
+            continue;
+        }
+        if (builtin_layouts[i].text) {
+            parse_layout(src,builtin_layouts[i].text,name,depth);
+            return;
+        }
+        /* US is the table we've always had */
+        for (uint16_t chr=0; chr<128; chr++) {
+            if (keycode[chr]) {
+                uint16_t stroke=(uint16_t)keycode[chr];
+                layout_add(src,chr,&stroke,1);
+            }
+        }
+        return;
+    }
+
+    /* not one of ours, must be a file */
+    FILE* fp=fopen(name,"r");
+    char* text=NULL;
+    long len=-1;
+    if ((fp)&&(fseek(fp,0,SEEK_END)==0)&&((len=ftell(fp))>=0)) {
+        rewind(fp);
+        text=malloc((size_t)len+1);
+    }
+    if ((text==NULL)||(fread(text,1,(size_t)len,fp)!=(size_t)len)) {
+        error(EXIT_FAILURE,errno,"Unable to read layout: '%s'",name);
+        /* no return */
+    }
+    text[len]=0;
+    fclose(fp);
+    parse_layout(src,text,name,depth);
+    free(text);
+}
+
+/* FNV-1a over a compiled layout, from just after the checksum */
+static uint32_t keymap_checksum(const layout_header* lay)
+{
+    const unsigned char* bytes=(const unsigned char*)lay;
+    uint32_t hash=2166136261u;
+
+    for (size_t i=offsetof(layout_header,pages); i<lay->size; i++) {
+        hash^=bytes[i];
+        hash*=16777619u;
+    }
+    return hash;
+}
+
+/* pack a layout into its flat, position independent form */
+static layout_header* compile_layout(const layout_source* src)
+{
+    /* which pages get used, and how many strokes all told */
+    static unsigned char used[LAYOUT_PAGES];
+    uint32_t pages=0;
+    size_t strokes=0;
+    memset(used,0,sizeof(used));
+    for (size_t i=0; i<src->count; i++) {
+        if (!used[src->defs[i].codepoint>>8]) {
+            used[src->defs[i].codepoint>>8]=1;
+            pages++;
+        }
+        strokes+=(size_t)src->defs[i].count;
+    }
+    if (strokes>0xffffff) {
+        error(EXIT_FAILURE,0,"Layout '%s' is too big",src->name);
+        /* no return */
+    }
+
+    size_t size=sizeof(layout_header)+pages*256*sizeof(uint32_t)+strokes*sizeof(uint16_t);
+    layout_header* lay=calloc(1,size);
+    if (lay==NULL) {
+        error(EXIT_FAILURE,errno,"Unable to build layout");
+        /* no return */
+    }
+    memcpy(lay->magic,LAYOUT_MAGIC,sizeof(lay->magic));
+    lay->version=LAYOUT_VERSION;
+    lay->size=(uint32_t)size;
+    lay->pages=pages;
+    lay->strokes=(uint32_t)strokes;
+    snprintf(lay->name,sizeof(lay->name),"%s",src->name);
+
+    /* pages go in codepoint order */
+    uint16_t page=0;
+    for (unsigned int i=0; i<LAYOUT_PAGES; i++) {
+        if (used[i]) {
+            lay->pagemap[i]=++page;
+        }
+    }
+
+    /* later definitions simply overwrite earlier ones */
+    uint32_t* entries=(uint32_t*)(lay+1);
+    uint16_t* pool=(uint16_t*)(entries+pages*256);
+    uint32_t offset=0;
+    for (size_t i=0; i<src->count; i++) {
+        const layout_def* def=&src->defs[i];
+        uint32_t* entry=&entries[(lay->pagemap[def->codepoint>>8]-1)*256+(def->codepoint&0xff)];
+        *entry=def->count?(((uint32_t)def->count<<24)|offset):0;
+        memcpy(pool+offset,def->strokes,(size_t)def->count*sizeof(uint16_t));
+        offset+=(uint32_t)def->count;
+    }
+    lay->checksum=keymap_checksum(lay);
+    return lay;
+}
+
+/* is this keymap file one of ours, whole and in one piece?  Entries   */
+/* are checked too, so a bad one can't send us wandering off the end.  */
+static const char* keymap_problem(const layout_header* lay, size_t size)
+{
+    if ((size<sizeof(layout_header))||(memcmp(lay->magic,LAYOUT_MAGIC,sizeof(lay->magic)))) {
+        return "not a keymap";
+    }
+    if (lay->version!=LAYOUT_VERSION) {
+        return "wrong version (or byte order)";
+    }
+    if ((lay->size!=size)||(lay->pages>LAYOUT_PAGES)||
+        (size!=sizeof(layout_header)+(size_t)lay->pages*256*sizeof(uint32_t)+(size_t)lay->strokes*sizeof(uint16_t))) {
+        return "truncated";
+    }
+    if (lay->checksum!=keymap_checksum(lay)) {
+        return "checksum mismatch";
+    }
+
+    for (unsigned int i=0; i<LAYOUT_PAGES; i++) {
+        if (lay->pagemap[i]>lay->pages) {
+            return "page out of range";
+        }
+    }
+    const uint32_t* entries=(const uint32_t*)(lay+1);
+    for (size_t i=0; i<(size_t)lay->pages*256; i++) {
+        if ((entries[i]>>24>LAYOUT_SEQ_MAX)||((entries[i]&0xffffff)+(entries[i]>>24)>lay->strokes)) {
+            return "entry out of range";
+        }
+    }
+    return NULL;
+}
+
+/* map a compiled keymap file, NULL if name isn't one (it may still be */
+/* a layout file).  Damaged keymaps are fatal, better than mistyping.  */
+static layout_header* map_keymap(const char* name, size_t* size)
+{
+    int fd=open(name,O_RDONLY|O_CLOEXEC);
+    if (fd<0) {
+        return NULL;
+    }
+
+    char magic[sizeof(LAYOUT_MAGIC)-1];
+    struct stat sb;
+    if ((pread(fd,magic,sizeof(magic),0)!=sizeof(magic))||(memcmp(magic,LAYOUT_MAGIC,sizeof(magic)))||(fstat(fd,&sb))) {
+        close(fd);
+        return NULL;
+    }
+
+    /* it's small, and all of it's wanted, so fault it in now */
+    void* map=mmap(NULL,(size_t)sb.st_size,PROT_READ,MAP_PRIVATE|MAP_POPULATE,fd,0);
+    close(fd);
+    if (map==MAP_FAILED) {
+        error(EXIT_FAILURE,errno,"Unable to map keymap: '%s'",name);
+        /* no return */
+    }
+
+    const char* problem=keymap_problem(map,(size_t)sb.st_size);
+    if (problem) {
+        error(EXIT_FAILURE,0,"Keymap '%s' is unusable: %s",name,problem);
+        /* no return */
+    }
+    *size=(size_t)sb.st_size;
+    return map;
+}
+
+/* --compile-keymap: build a layout, write it out ready to be mapped */
+static int write_keymap(const char* name, const char* filename)
+{
+    layout_source src;
+    memset(&src,0,sizeof(src));
+    load_layout_source(&src,name,0);
+    layout_header* lay=compile_layout(&src);
+    free(src.defs);
+
+    /* into place in one step, so nobody maps half a keymap */
+    char tmpname[PATH_MAX];
+    snprintf(tmpname,sizeof(tmpname),"%s.XXXXXX",filename);
+    int fd=mkstemp(tmpname);
+    if (fd<0) {
+        error(0,errno,"Unable to create keymap: '%s'",filename);
+        free(lay);
+        return EXIT_FAILURE;
+    }
+    fchmod(fd,0644);
+    if ((write_full(fd,lay,lay->size))||(fsync(fd))||(close(fd))||(rename(tmpname,filename))) {
+        error(0,errno,"Unable to write keymap: '%s'",filename);
+        unlink(tmpname);
+        free(lay);
+        return EXIT_FAILURE;
+    }
+
+    if (verbose_mode) {
+        fprintf(stderr,"Keymap '%s': %u strokes, %u pages, %u bytes, checksum %08x, written to %s\n",
+                lay->name,lay->strokes,lay->pages,lay->size,lay->checksum,filename);
+    }
+    free(lay);
+    return EXIT_SUCCESS;
+}
+
+/* make lay the layout everything is typed through, mapped is its */
+/* size if it came from a keymap file, 0 if built on the heap      */
+static void use_layout(layout_header* lay, size_t mapped)
+{
+    if (layout) {
+        /* cached events belong to the old one, the first time they */
+        /* start out empty, and untouched saves faulting them all in */
+        memset(templates,0,sizeof(templates));
+        if (layout_mapped) {
+            munmap(layout,layout_mapped);
+        } else {
+            free(layout);
+        }
+    }
+    layout=lay;
+    layout_mapped=mapped;
+    reverse_built=0;
+}
+
+/* note every key the layout presses, so the device can claim them */
+static void layout_keys(void)
+{
+    const uint16_t* pool=layout_strokes(layout,0);
+    for (uint32_t i=0; i<layout->strokes; i++) {
+        use_key(pool[i]&STROKE_KEY);
+    }
+}
+
+/* note every key the escape sequence decoder can press */
+static void vt_keys(void)
+{
+    for (unsigned int i=0; i<sizeof(vt_final)/sizeof(vt_final[0]); i++) {
+        use_key(vt_final[i]&STROKE_KEY);
+    }
+    for (unsigned int i=0; i<sizeof(vt_ss3_only)/sizeof(vt_ss3_only[0]); i++) {
+        use_key(vt_ss3_only[i]&STROKE_KEY);
+    }
+    for (unsigned int i=0; i<sizeof(vt_tilde)/sizeof(vt_tilde[0]); i++) {
+        use_key(vt_tilde[i]&STROKE_KEY);
+    }
+    for (unsigned int i=0; i<sizeof(vt_linux)/sizeof(vt_linux[0]); i++) {
+        use_key(vt_linux[i]);
+    }
+}
+
+/* set up reverse lookups for the decoder, walking the whole layout */
+static void build_reverse(void)
+{
+    if (reverse_built) {
+        return;
+    }
+    memset(keyrev,-1,sizeof(keyrev));
+    multistroke_count=0;
+
+    for (uint32_t codepoint=0; codepoint<LAYOUT_CODEPOINTS; codepoint++) {
+        if (layout->pagemap[codepoint>>8]==0) {
+            /* skip the whole empty page */
+            codepoint|=0xff;
+            continue;
+        }
+        uint32_t entry=layout_entry(layout,codepoint);
+        int count=(int)(entry>>24);
+        const uint16_t* strokes=layout_strokes(layout,entry);
+
+        if (count==1) {
+            /* first one wins if two characters share a key */
+            unsigned int key=strokes[0]&STROKE_KEY;
+            if ((key<256)&&(keyrev[key][strokes[0]>>12]<0)) {
+                keyrev[key][strokes[0]>>12]=(int32_t)codepoint;
+            }
+        } else if (count>1) {
+            if ((multistroke_count&255)==0) {
+                multistroke=realloc(multistroke,(multistroke_count+256)*sizeof(multistroke[0]));
+                if (multistroke==NULL) {
+                    error(EXIT_FAILURE,errno,"Unable to build layout");
+                    /* no return */
+                }
+            }
+            multistroke[multistroke_count++]=codepoint;
+        }
+    }
+    reverse_built=1;
+}
+
+/* start using a layout by name: a compiled keymap file is mapped in */
+/* as it is, anything else (built-in or layout file) is built here   */
+static void select_layout(const char* name)
+{
+    long long start=now_ns();
+    size_t mapped=0;
+    layout_header* lay=NULL;
+
+    int builtin=0;
+    for (unsigned int i=0; i<sizeof(builtin_layouts)/sizeof(builtin_layouts[0]); i++) {
+        builtin|=(strcmp(name,builtin_layouts[i].name)==0);
+    }
+    if (!builtin) {
+        lay=map_keymap(name,&mapped);
+    }
+    if (lay==NULL) {
+        layout_source src;
+        memset(&src,0,sizeof(src));
+        load_layout_source(&src,name,0);
+        lay=compile_layout(&src);
+        free(src.defs);
+    }
+    use_layout(lay,mapped);
+
+    if (verbose_mode) {
+        fprintf(stderr,"Layout '%s': %u strokes, %u pages, %u bytes, %s in %.3fms\n",
+                layout->name,layout->strokes,layout->pages,layout->size,
+                mapped?"mapped":"built",(double)(now_ns()-start)/1e6);
+    }
+}
+
+/* modifier state while turning events back into text, plus */
+/* strokes seen so far of a character which takes several    */
+typedef struct {
+    uint16_t mods;
+    int pending;
+    uint16_t strokes[LAYOUT_SEQ_MAX];
+} key_decoder;
+
+/* feed one event to the decoder, returns the codepoint typed or -1 if none */
+static int32_t decode_event(key_decoder* dec, const struct input_event* event)
+{
+    if (event->type!=EV_KEY) {
+        return -1;
+    }
+
+    /* track modifiers, either side will do, bar ALTGR */
+    uint16_t flag=0;
+    switch (event->code) {
+        case KEY_LEFTSHIFT:
+        case KEY_RIGHTSHIFT:
+            flag=US;
+            break;
+        case KEY_LEFTCTRL:
+        case KEY_RIGHTCTRL:
+            flag=UC;
+            break;
+        case KEY_RIGHTALT:
+            flag=UG;
+            break;
+        case KEY_LEFTALT:
+            flag=UA;
+            break;
+    }
+    if (flag) {
+        dec->mods=(uint16_t)(event->value?(dec->mods|flag):(dec->mods&~flag));
+        return -1;
+    }
+
+    /* only presses type anything, autorepeat (2) counts too */
+    if ((event->value==0)||(event->code>=256)) {
+        return -1;
+    }
+    uint16_t stroke=event->code|dec->mods;
+    dec->strokes[dec->pending++]=stroke;
+
+    while (1) {
+        /* part of something which takes several strokes? */
+        int prefix=0;
+        for (size_t i=0; i<multistroke_count; i++) {
+            uint32_t entry=layout_entry(layout,multistroke[i]);
+            int count=(int)(entry>>24);
+            if ((count<dec->pending)||(memcmp(layout_strokes(layout,entry),dec->strokes,(size_t)dec->pending*sizeof(uint16_t)))) {
+                continue;
+            }
+            if (count==dec->pending) {
+                dec->pending=0;
+                return (int32_t)multistroke[i];
+            }
+            prefix=1;
+        }
+        if (prefix) {
+            /* see what comes next */
+            return -1;
+        }
+        if (dec->pending==1) {
+            dec->pending=0;
+            return keyrev[stroke&STROKE_KEY][stroke>>12];
+        }
+        /* went nowhere, start over from this stroke */
+        dec->strokes[0]=stroke;
+        dec->pending=1;
+    }
+}
+
+/* turn an event sequence back into the character it types, -1 if it    */
+/* doesn't type exactly one.  Used to prove the layout tables are sane.  */
+static int32_t decode_template(const struct input_event* events, int count)
+{
+    key_decoder dec;
+    int32_t found=-1;
+    memset(&dec,0,sizeof(dec));
+
+    /* SYN frames, and nothing left hanging after the last one */
+    if ((count==0)||(events[count-1].type!=EV_SYN)) {
+        return -1;
+    }
+    build_reverse();
+    for (int i=0; i<count; i++) {
+        if (events[i].type==EV_SYN) {
+            continue;
+        }
+        if (events[i].type!=EV_KEY) {
+            return -1;
+        }
+        int32_t chr=decode_event(&dec, &events[i]);
+        if (chr>=0) {
+            /* only one character per template */
+            if (found>=0) {
+                return -1;
+            }
+            found=chr;
+        }
+    }
+    /* everything pressed must have been released again */
+    if ((dec.mods)||(dec.pending)) {
+        return -1;
+    }
+    return found;
+}
+
+/* turn a captured raw event stream back into text on stdout */
+static void decode_stream(const char* filename)
+{
+    int fd=0;
+    if (strcmp(filename,"-")!=0) {
+        fd=open(filename,O_RDONLY);
+        if (fd<0) {
+            error(EXIT_FAILURE,errno,"Unable to open capture: '%s'",filename);
+            /* no return */
+        }
+    }
+
+    key_decoder dec;
+    memset(&dec,0,sizeof(dec));
+    struct input_event events[256];
+    build_reverse();
+    size_t have=0;
+    unsigned long count=0;
+
+    while (1) {
+        ssize_t num_read=read(fd,(char*)events+have,sizeof(events)-have);
+        if (num_read<0) {
+            if (errno==EINTR) {
+                continue;
+            }
+            error(EXIT_FAILURE,errno,"Error reading capture");
+            /* no return */
+        }
+        if (num_read==0) {
+            break;
+        }
+        have+=(size_t)num_read;
+
+        /* process whole events, keep any partial one for next time */
+        size_t num_events=have/sizeof(events[0]);
+        for (size_t i=0; i<num_events; i++) {
+            int32_t chr=decode_event(&dec, &events[i]);
+            if (chr>=0) {
+                put_utf8((uint32_t)chr);
+            }
+        }
+        count+=num_events;
+        have-=num_events*sizeof(events[0]);
+        memmove(events,(char*)events+num_events*sizeof(events[0]),have);
+    }
+
+    if (have) {
+        fprintf(stderr,"Capture ends with a partial event (%u bytes)\n",(unsigned int)have);
+    }
+    if (verbose_mode) {
+        fprintf(stderr,"Decoded %lu events\n",count);
+    }
+    if (fd) {
+        close(fd);
+    }
+}
+
+/* sleep until an absolute time, so time spent working doesn't add up */
+static void sleep_until(long long deadline)
+{
+    struct timespec ts={ (time_t)(deadline/1000000000LL), (long)(deadline%1000000000LL) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)==EINTR) {
+        /* try again, unless we're being told to stop */
+        if (abort_requested) {
+            break;
+        }
+    }
+}
+
+/* is this pacing schedule doing anything? */
+static int pace_active(void)
+{
+    return (pace.gap>0)||(pace.eol_gap>0);
+}
+
+/* when may the next character go? 0 means right now.  Deadlines are */
+/* absolute, each character's slot follows on from the last one's, so */
+/* time taken translating and writing doesn't stretch the schedule.   */
+static long long pace_due(void)
+{
+    if ((!pace_active())||(pace.tat==0)) {
+        /* first character goes right away */
+        return 0;
+    }
+
+    /* up to 'burst' characters may go early, but never before the floor */
+    long long due=pace.tat-(long long)(pace.burst-1)*pace.gap;
+    if (due<pace.floor) {
+        due=pace.floor;
+    }
+    return due;
+}
+
+/* wait until the next character is due */
+static void pace_wait(void)
+{
+    if (!pace_active()) {
+        return;
+    }
+
+    long long now=now_ns();
+    if (pace.tat==0) {
+        pace.tat=now;
+        pace.floor=now;
+        pace.start=now;
+    }
+
+    long long due=pace_due();
+    if (now<due) {
+        /* pausing is pointless unless the key has actually been sent */
+        flush_events(&out);
+        if (uring.fd>=0) {
+            /* or have the kernel hold the next write back until it's due. */
+            /* Nobody sleeps here, so there's no pace stage to time, and    */
+            /* how late the write went isn't ours to see.                   */
+            uring.due=due;
+            return;
+        }
+        long long t0=now_ns();
+        sleep_until(due);
+        stage_add(STAGE_PACE, t0);
+        if (stats_pending) {
+            stats_service();
+        }
+    } else if (now>pace.tat) {
+        /* we've fallen behind, note it and carry on from here */
+        long long late=now-pace.tat;
+        pace.late_total+=late;
+        if (late>pace.late_max) {
+            pace.late_max=late;
+        }
+        pace.late_count++;
+        pace.tat=now;
+    }
+}
+
+/* nothing to type for a while, which isn't the schedule's fault */
+static void pace_idle(void)
+{
+    if ((pace_active())&&(pace.tat)) {
+        long long now=now_ns();
+        if (now>pace.tat) {
+            pace.tat=now;
+        }
+    }
+}
+
+/* each send gets its own drift figures, and the time since the */
+/* last one isn't counted against it                            */
+static void pace_reset(void)
+{
+    pace_idle();
+    pace.start=now_ns();
+    pace.chars=0;
+    pace.late_count=0;
+    pace.late_total=0;
+    pace.late_max=0;
+}
+
+/* work out when the character after this one is due */
+static void pace_sent(int chr)
+{
+    if (!pace_active()) {
+        return;
+    }
+
+    /* did we send a carriage return? (or linefeed?) */
+    if (((chr==13)||(chr==10))&&(pace.eol_gap>=0)) {
+        /* line ends get their own pause, with no bursting past it */
+        pace.tat+=pace.eol_gap;
+        pace.floor=pace.tat;
+    } else {
+        pace.tat+=pace.gap;
+    }
+    pace.chars++;
+}
+
+/* type one character by way of the current layout, or a raw stroke */
+/* at RAW_STROKE_BASE+stroke                                         */
+static void send_entry(uint32_t codepoint)
+{
+    /* translation timed now and then, pacing left out */
+    long long t0=((++stats_tick%STATS_SAMPLE)==0)?now_ns():0;
+    long long paced=0;
+
+    keytemplate* tmpl=&templates[codepoint%TEMPLATE_CACHE];
+    if ((optimize_keys)||(tmpl->count==0)||(tmpl->codepoint!=codepoint)) {
+        /* not seen lately (or optimizing), look it up */
+        uint16_t raw=(uint16_t)(codepoint-RAW_STROKE_BASE);
+        const uint16_t* strokes=&raw;
+        int count=1;
+        if (codepoint<RAW_STROKE_BASE) {
+            uint32_t entry=layout_entry(layout, codepoint);
+            if (entry==0) {
+                /* nothing on this keyboard types it */
+                stat_unmapped++;
+                return;
+            }
+            strokes=layout_strokes(layout, entry);
+            count=(int)(entry>>24);
+        }
+
+        if (optimize_keys) {
+            paced=((t0)&&(pace_active()))?now_ns():0;
+            pace_wait();
+            paced=paced?now_ns()-paced:0;
+            for (int i=0; i<count; i++) {
+                opt_stroke(&out, strokes[i]);
+            }
+            stat_chars++;
+            if (out.evbuf_count>=batch_events) {
+                flush_events(&out);
+            }
+            pace_sent((int)codepoint);
+            if (t0) {
+                hist_add(&stage_ns[STAGE_TRANSLATE], now_ns()-t0-paced);
+            }
+            return;
+        }
+
+        /* build its events, for next time too */
+        tmpl->codepoint=codepoint;
+        tmpl->count=expand_strokes(strokes, count, tmpl->events);
+    }
+
+    /* wait for our turn, if we're pacing */
+    paced=((t0)&&(pace_active()))?now_ns():0;
+    pace_wait();
+    paced=paced?now_ns()-paced:0;
+
+    queue_frame(&out, tmpl->events, tmpl->count);
+    stat_chars++;
+
+    /* when can the next one go? */
+    pace_sent((int)codepoint);
+    if (t0) {
+        hist_add(&stage_ns[STAGE_TRANSLATE], now_ns()-t0-paced);
+    }
+}
+
+/* type one character of text.  Nothing up where raw strokes are kept, */
+/* or past the end of Unicode, is anything a keyboard types.            */
+static void send_codepoint(uint32_t codepoint)
+{
+    if (codepoint>=RAW_STROKE_BASE) {
+        stat_unmapped++;
+        return;
+    }
+    send_entry(codepoint);
+}
+
+/* type one key stroke (key | modifiers) as it is, skipping the layout */
+static void send_stroke(uint16_t stroke)
+{
+    send_entry(RAW_STROKE_BASE+stroke);
+}
+
+/* feed one byte of UTF-8 text, typing each character as it completes. */
+/* Stray bytes and broken or overlong sequences are dropped.           */
+static void sendchar(int any_byte)
+{
+    unsigned int byte=(unsigned char)any_byte;
+
+    if (byte<0x80) {
+        /* plain ASCII, which also cuts short anything half done */
+        utf8_pending=0;
+        send_codepoint(byte);
+        return;
+    }
+
+    if (byte<0xc0) {
+        /* continuation, only any good if we're expecting one */
+        if (utf8_pending==0) {
+            return;
+        }
+        utf8_codepoint=(utf8_codepoint<<6)|(byte&0x3f);
+        if (--utf8_pending==0) {
+            if ((utf8_codepoint>=utf8_min)&&((utf8_codepoint<0xd800)||(utf8_codepoint>0xdfff))) {
+                send_codepoint(utf8_codepoint);
+            }
+        }
+        return;
+    }
+
+    /* lead byte, says how many more are coming */
+    if (byte<0xe0) {
+        utf8_pending=1;
+        utf8_min=0x80;
+        utf8_codepoint=byte&0x1f;
+    } else if (byte<0xf0) {
+        utf8_pending=2;
+        utf8_min=0x800;
+        utf8_codepoint=byte&0x0f;
+    } else if (byte<0xf5) {
+        utf8_pending=3;
+        utf8_min=0x10000;
+        utf8_codepoint=byte&0x07;
+    } else {
+        utf8_pending=0;
+    }
+}
+
+/* wait for path to turn up in dir, until deadline (ns) */
+/* returns 0 if it did, -1 if we ran out of time          */
+static int wait_for_path(const char* dir, const char* path, long long deadline)
+{
+    int ifd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (ifd>=0) {
+        inotify_add_watch(ifd, dir, IN_CREATE|IN_MOVED_TO|IN_ATTRIB);
+    }
+
+    int found=-1;
+    while (1) {
+        /* watch is in place before we look, so nothing slips past */
+        if (access(path, F_OK)==0) {
+            found=0;
+            break;
+        }
+        long long left=deadline-now_ns();
+        if (left<=0) {
+            break;
+        }
+        if (ifd<0) {
+            /* no inotify, fall back to looking every millisecond */
+            usleep(1000);
+            continue;
+        }
+        struct pollfd pfd={ ifd, POLLIN, 0 };
+        if (poll(&pfd, 1, (int)(left/1000000)+1)>0) {
+            char buffer[4096];
+            while (read(ifd, buffer, sizeof(buffer))>0) {
+                /* just draining, we look for ourselves */
+            }
+        }
+    }
+
+    if (ifd>=0) {
+        close(ifd);
+    }
+    return found;
+}
+
+/* find the eventN node the kernel hung off our inputN, and its dev_t */
+static int find_event_node(const char* sysname, char* event, size_t len, int* major, int* minor)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s", sysname);
+    DIR* dir=opendir(path);
+    if (dir==NULL) {
+        return -1;
+    }
+
+    int found=-1;
+    struct dirent* entry;
+    while ((entry=readdir(dir))!=NULL) {
+        if (strncmp(entry->d_name, "event", 5)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s/%s/dev", sysname, entry->d_name);
+        FILE* fp=fopen(path, "r");
+        if (fp) {
+            if (fscanf(fp, "%d:%d", major, minor)==2) {
+                snprintf(event, len, "%s", entry->d_name);
+                found=0;
+            }
+            fclose(fp);
+        }
+        break;
+    }
+    closedir(dir);
+    return found;
+}
+
+/* Block until the new device is really there for everyone.  The console */
+/* keyboard handler attaches during UI_DEV_CREATE, but anything reading  */
+/* /dev/input (X, libinput, logind) needs the node, and udev to be done  */
+/* with it.  Watch for both with inotify rather than guessing a sleep.   */
+static const char* wait_uinput_ready(int ufile)
+{
+    static char sysname[64];
+    static char ready[sizeof(sysname)+NAME_MAX+16];
+    char event[NAME_MAX+1];
+    char path[PATH_MAX];
+    int major, minor;
+
+    if (ready_wait<=0) {
+        return "not waiting";
+    }
+    if (ioctl(ufile, UI_GET_SYSNAME(sizeof(sysname)), sysname)<0) {
+        return "kernel can't say";
+    }
+    if (find_event_node(sysname, event, sizeof(event), &major, &minor)) {
+        /* no evdev attached, only the console will see us, and it has */
+        return sysname;
+    }
+
+    long long deadline=now_ns()+(long long)ready_wait*1000000LL;
+    snprintf(path, sizeof(path), "/dev/input/%s", event);
+    if (wait_for_path("/dev/input", path, deadline)) {
+        return "timed out waiting for device node";
+    }
+
+    /* udev running? then wait for it to finish with us too */
+    if (access("/run/udev/control", F_OK)==0) {
+        snprintf(path, sizeof(path), "/run/udev/data/c%d:%d", major, minor);
+        if (wait_for_path("/run/udev/data", path, deadline)) {
+            return "timed out waiting for udev";
+        }
+    }
+
+    snprintf(ready, sizeof(ready), "%s, /dev/input/%s", sysname, event);
+    return ready;
+}
+
+/* perform initial setup to create uinput device */
+static int create_uinput(void)
+{
+    long long t0=now_ns();
+
+    /* Attempt to open uinput to create new device */
+    int ufile = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (ufile<0) {
+        error(1, errno, "Could not open uinput device");
+    }
+    long long t1=now_ns();
+
+    /* we handle EV_SYN, EV_KEY & EV_REP events (and EV_REL, below) */
+    ioctl(ufile, UI_SET_EVBIT, EV_SYN);
+    ioctl(ufile, UI_SET_EVBIT, EV_KEY);
+    ioctl(ufile, UI_SET_EVBIT, EV_REP);
+
+    /* only claim the keys we can actually send, unless passing */
+    /* along someone else's, when anything goes                 */
+    layout_keys();
+    vt_keys();
+    for (unsigned int i=0; i<sizeof(modifier_keys)/sizeof(modifier_keys[0]); i++) {
+        use_key(modifier_keys[i]);
+    }
+
+    /* mouse buttons and motion, for -m or anyone else's mouse */
+    int with_mouse=(mouse_source!=NULL)||(all_keys);
+    if (with_mouse) {
+        ioctl(ufile, UI_SET_EVBIT, EV_REL);
+        for (unsigned int i=0; i<sizeof(mouse_axes)/sizeof(mouse_axes[0]); i++) {
+            ioctl(ufile, UI_SET_RELBIT, mouse_axes[i]);
+        }
+        for (unsigned int i=BTN_LEFT; i<=BTN_TASK; i++) {
+            use_key(i);
+        }
+    }
+
+    int num_keys=0;
+    for (int i=1; i<KEY_CNT; i++) {
+        if ((all_keys)||(keybits[i/8]&(1<<(i%8)))) {
+            ioctl(ufile, UI_SET_KEYBIT, i);
+            num_keys++;
+        }
+    }
+
+    /* made up values, but didn't find anything using these values */
+    struct input_id id;
+    memset(&id, 0, sizeof(id));
+    id.bustype = BUS_USB;
+    id.vendor  = 0x9642;
+    id.product = 0x0d0d;
+    id.version = 13;
+
+    /* modern kernels (uinput 5+) take it all in one ioctl */
+    unsigned int version=0;
+    int legacy=((ioctl(ufile, UI_GET_VERSION, &version))||(version<5));
+    if (!legacy) {
+        struct uinput_setup setup;
+        memset(&setup, 0, sizeof(setup));
+        setup.id=id;
+        strncpy(setup.name, with_mouse?"Faux Keyboard & Mouse":"Faux Keyboard", UINPUT_MAX_NAME_SIZE-1);
+        if (ioctl(ufile, UI_DEV_SETUP, &setup)) {
+            legacy=1;
+        }
+    }
+    if (legacy) {
+        /* structure with name and other info */
+        struct uinput_user_dev uinp;
+        memset(&uinp, 0, sizeof(uinp));
+        strncpy(uinp.name, with_mouse?"Faux Keyboard & Mouse":"Faux Keyboard", UINPUT_MAX_NAME_SIZE-1);
+        uinp.id=id;
+
+        /* write data out to prepare for the magic */
+        ssize_t res=write(ufile, &uinp, sizeof(uinp));
+        if (res!=sizeof(uinp)) {
+            close(ufile);
+            error(2, errno, "Write error: %d (actual) != %d (expected)", (signed int)res, (signed int)sizeof(uinp));
+            /* no return */
+        }
+    }
+    long long t2=now_ns();
+
+    /* magic happens here, honest */
+    int retcode = ioctl(ufile, UI_DEV_CREATE);
+    if (retcode) {
+        close(ufile);
+        error(2, errno, "Ioctl error: %d", retcode);
+        /* no return */
+    }
+    long long t3=now_ns();
+
+    /* don't let the first keystrokes fall on the floor */
+    const char* ready=wait_uinput_ready(ufile);
+    long long t4=now_ns();
+
+    if (verbose_mode) {
+        fprintf(stderr,"uinput: open %.3fms, setup %.3fms (%d keys, %s), create %.3fms, ready %.3fms (%s), total %.3fms\n",
+                (double)(t1-t0)/1e6,(double)(t2-t1)/1e6,num_keys,legacy?"legacy":"UI_DEV_SETUP",
+                (double)(t3-t2)/1e6,(double)(t4-t3)/1e6,ready,(double)(t4-t0)/1e6);
+    }
+    return ufile;
+}
+
+/* tear down uinput device and close file descriptor */
+static void destroy_uinput(int ufile)
+{
+    /* skip checking retval, not concerned */
+    ioctl(ufile, UI_DEV_DESTROY);
+    close(ufile);
+}
+
+/* swap hellos with the other end, 0 if it speaks our protocol */
+static int wire_hello(int in_fd, int out_fd)
+{
+    unsigned char hello[WIRE_HELLO_SIZE]={ 'F', 'X', 'C', 'N', WIRE_VERSION, 0, 0, 0 };
+    unsigned char reply[WIRE_HELLO_SIZE];
+
+    if (write_full(out_fd, hello, sizeof(hello))) {
+        return -1;
+    }
+    if (read_full(in_fd, reply, sizeof(reply))!=1) {
+        return -1;
+    }
+    if ((memcmp(reply, WIRE_MAGIC, 4))||(reply[4]!=WIRE_VERSION)) {
+        errno=EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+/* split 'host:port' (host optional, may be [v6]) and resolve it.  No  */
+/* host means localhost, listening too: every interface has to be asked */
+/* for, as 0.0.0.0 or [::]                                              */
+static struct addrinfo* resolve(const char* spec)
+{
+    char host[256];
+    const char* port=strrchr(spec, ':');
+    if (port) {
+        size_t len=(size_t)(port-spec);
+        if (len>=sizeof(host)) {
+            len=sizeof(host)-1;
+        }
+        memcpy(host, spec, len);
+        host[len]=0;
+        port++;
+    } else {
+        /* just a port */
+        host[0]=0;
+        port=spec;
+    }
+
+    /* strip brackets from [::1] */
+    char* hostp=host;
+    if ((hostp[0]=='[')&&(hostp[strlen(hostp)-1]==']')) {
+        hostp[strlen(hostp)-1]=0;
+        hostp++;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_STREAM;
+
+    struct addrinfo* result=NULL;
+    int rc=getaddrinfo(hostp[0]?hostp:"localhost", port, &hints, &result);
+    if (rc) {
+        error(EXIT_FAILURE, 0, "Unable to resolve '%s': %s", spec, gai_strerror(rc));
+        /* no return */
+    }
+    return result;
+}
+
+/* fill in a unix socket address, complaining if the path won't fit */
+static void unix_address(struct sockaddr_un* addr, const char* path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family=AF_UNIX;
+    if (strlen(path)>=sizeof(addr->sun_path)) {
+        error(EXIT_FAILURE, 0, "Socket path too long: '%s'", path);
+        /* no return */
+    }
+    strcpy(addr->sun_path, path);
+}
+
+/* connect to a remote fauxcon: tcp:host:port, unix:path or ssh:host */
+/* (which runs 'fauxcon -C -L -' over there, much like rsync does)   */
+static int connect_remote(const char* spec, pid_t* child)
+{
+    int fd=-1;
+    *child=0;
+
+    if (strncmp(spec, "tcp:", 4)==0) {
+        struct addrinfo* addrs=resolve(spec+4);
+        for (struct addrinfo* ai=addrs; ai; ai=ai->ai_next) {
+            fd=socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd<0) {
+                continue;
+            }
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen)==0) {
+                break;
+            }
+            close(fd);
+            fd=-1;
+        }
+        freeaddrinfo(addrs);
+        if (fd>=0) {
+            /* every keystroke goes now, not when Nagle feels like it */
+            int one=1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    } else if (strncmp(spec, "unix:", 5)==0) {
+        struct sockaddr_un addr;
+        unix_address(&addr, spec+5);
+        fd=socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if ((fd>=0)&&(connect(fd, (struct sockaddr*)&addr, sizeof(addr)))) {
+            close(fd);
+            fd=-1;
+        }
+    } else if (strncmp(spec, "ssh:", 4)==0) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) {
+            error(EXIT_FAILURE, errno, "Unable to create socket pair");
+            /* no return */
+        }
+        *child=fork();
+        if (*child<0) {
+            error(EXIT_FAILURE, errno, "Unable to start ssh");
+            /* no return */
+        }
+        if (*child==0) {
+            /* ssh talks to us on its stdin/stdout, leave our tty alone */
+            dup2(pair[1], 0);
+            dup2(pair[1], 1);
+            close(pair[0]);
+            close(pair[1]);
+            execlp("ssh", "ssh", "-T", "-e", "none", spec+4, "fauxcon", "-C", "-L", "-", (char*)NULL);
+            error(127, errno, "Unable to run ssh");
+        }
+        close(pair[1]);
+        fd=pair[0];
+    }
+
+    if (fd<0) {
+        error(EXIT_FAILURE, errno, "Unable to connect to '%s'", spec);
+        /* no return */
+    }
+    if (wire_hello(fd, fd)) {
+        error(EXIT_FAILURE, errno, "No fauxcon answering at '%s'", spec);
+        /* no return */
+    }
+    return fd;
+}
+
+/* set up the output named by spec: uinput, null, capture:PATH, fd:N or */
+/* a remote fauxcon (tcp:, unix:, ssh:).  PATH '-' captures to stdout,  */
+/* and everything else we'd have written there goes to stderr instead   */
+static void open_sink(sink* snk, const char* spec)
+{
+    snk->evbuf_count=0;
+    snk->events=0;
+    snk->writes=0;
+
+    if (strcmp(spec,"uinput")==0) {
+        snk->type=SINK_UINPUT;
+        snk->fd=create_uinput();
+    } else if (strcmp(spec,"null")==0) {
+        snk->type=SINK_NULL;
+        snk->fd=-1;
+    } else if (strncmp(spec,"capture:",8)==0) {
+        snk->type=SINK_CAPTURE;
+        const char* path=spec+8;
+        if (strcmp(path,"-")==0) {
+            snk->fd=dup(1);
+            /* nothing else gets into the stream */
+            fflush(stdout);
+            log_fd=2;
+        } else {
+            snk->fd=open(path,O_WRONLY|O_CREAT|O_TRUNC,0644);
+        }
+        if (snk->fd<0) {
+            error(EXIT_FAILURE,errno,"Unable to open capture file: '%s'",path);
+            /* no return */
+        }
+    } else if (strncmp(spec,"fd:",3)==0) {
+        snk->type=SINK_CAPTURE;
+        char* endptr=NULL;
+        snk->fd=(int)strtol(spec+3,&endptr,0);
+        if ((*endptr)||(snk->fd<0)||(fcntl(snk->fd,F_GETFD)<0)) {
+            error(EXIT_FAILURE,errno,"Bad capture descriptor: '%s'",spec);
+            /* no return */
+        }
+    } else if ((strncmp(spec,"tcp:",4)==0)||(strncmp(spec,"unix:",5)==0)||(strncmp(spec,"ssh:",4)==0)) {
+        snk->type=SINK_REMOTE;
+        snk->fd=connect_remote(spec,&snk->child);
+    } else {
+        error(EXIT_FAILURE,0,"Unknown output (-o|--output): '%s'",spec);
+        /* no return */
+    }
+}
+
+/* flush anything still queued, then release whatever is behind the sink */
+static void close_sink(sink* snk)
+{
+    /* anything still queued goes out first, then let go of everything */
+    flush_events(snk);
+    if (snk==&out) {
+        uring_finish();
+    }
+    record_close();
+    release_keys(snk);
+
+    if (snk->type==SINK_UINPUT) {
+        destroy_uinput(snk->fd);
+    } else if (snk->type==SINK_CAPTURE) {
+        close(snk->fd);
+    } else if (snk->type==SINK_REMOTE) {
+        /* say goodbye nicely, then wait for ssh (if it's ours) */
+        unsigned char bye[WIRE_HEADER_SIZE]={ MSG_BYE, 0, 0, 0, 0, 0, 0, 0 };
+        if (write_full(snk->fd,bye,sizeof(bye))==0) {
+            shutdown(snk->fd,SHUT_WR);
+        }
+        close(snk->fd);
+        if (snk->child>0) {
+            waitpid(snk->child,NULL,0);
+        }
+    }
+    /* mark it invalid */
+    snk->fd=-1;
+}
+
+/* Echo (-vv/-vvv) and the notes around it go through a ring which a  */
+/* logger thread drains to log_fd, so a slow terminal (ssh, serial)    */
+/* can't hold up typing.  One writer, the main thread, and one reader, */
+/* so head and tail are all the synchronisation there is.  When it's   */
+/* full, echo is dropped and counted rather than waited for.  Without  */
+/* -vv it's plain stdio: having a thread at all costs every write.     */
+#define LOG_RING (256*1024)
+#define LOG_POLL_MS 10
+#define LOG_DRAIN_MS 1000
+typedef struct {
+    char data[LOG_RING];
+    size_t head;            /* moved by the main thread only */
+    size_t tail;            /* moved by the logger only */
+    int stopping;
+    int running;
+    unsigned long dropped;
+    pid_t pid;
+    pthread_t thread;
+} log_ring;
+static log_ring logbuf;
+
+static void* log_thread(void* arg)
+{
+    (void)arg;
+    for (;;) {
+        /* look at stopping first, so nothing queued before it is missed */
+        int stopping=__atomic_load_n(&logbuf.stopping,__ATOMIC_ACQUIRE);
+        size_t tail=logbuf.tail;
+        size_t head=__atomic_load_n(&logbuf.head,__ATOMIC_ACQUIRE);
+        if (head==tail) {
+            if (stopping) {
+                break;
+            }
+            /* nobody's reading echo closer than this anyway */
+            struct timespec ts={ 0, LOG_POLL_MS*1000000L };
+            nanosleep(&ts,NULL);
+            continue;
+        }
+
+        size_t at=tail%LOG_RING;
+        size_t len=head-tail;
+        if (len>LOG_RING-at) {
+            len=LOG_RING-at;
+        }
+        ssize_t num_written=write(log_fd,logbuf.data+at,len);
+        if (num_written<0) {
+            if (errno==EINTR) {
+                continue;
+            }
+            /* stdout shares the terminal's non-blocking flag in connect_user() */
+            if (errno==EAGAIN) {
+                struct pollfd pfd={ log_fd, POLLOUT, 0 };
+                poll(&pfd,1,LOG_POLL_MS);
+                continue;
+            }
+            /* stdout's gone, nothing more will show */
+            num_written=(ssize_t)len;
+        }
+        __atomic_store_n(&logbuf.tail,tail+(size_t)num_written,__ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* the stdio stream for log_fd, for when there's no logger */
+static FILE* log_stream(void)
+{
+    return (log_fd==1)?stdout:stderr;
+}
+
+/* queue some echo, or drop it if the terminal's that far behind */
+static void log_write(const char* text, size_t len)
+{
+    if (!logbuf.running) {
+        fwrite(text,1,len,log_stream());
+        return;
+    }
+    size_t head=logbuf.head;
+    size_t tail=__atomic_load_n(&logbuf.tail,__ATOMIC_ACQUIRE);
+    if (LOG_RING-(head-tail)<len) {
+        logbuf.dropped+=len;
+        return;
+    }
+    size_t at=head%LOG_RING;
+    size_t first=(len<LOG_RING-at)?len:LOG_RING-at;
+    memcpy(logbuf.data+at,text,first);
+    memcpy(logbuf.data,text+first,len-first);
+    __atomic_store_n(&logbuf.head,head+len,__ATOMIC_RELEASE);
+}
+
+static void log_printf(const char* format, ...) __attribute__((format(printf,1,2)));
+static void log_printf(const char* format, ...)
+{
+    char line[1024];
+    va_list args;
+    va_start(args,format);
+    int len=vsnprintf(line,sizeof(line),format,args);
+    va_end(args);
+    if (len>0) {
+        log_write(line,((size_t)len<sizeof(line))?(size_t)len:sizeof(line)-1);
+    }
+}
+
+/* let the logger catch up (for a while), then say what was lost */
+static void log_stop(void)
+{
+    /* a forked child failing to exec has no logger */
+    if ((!logbuf.running)||(getpid()!=logbuf.pid)) {
+        return;
+    }
+    __atomic_store_n(&logbuf.stopping,1,__ATOMIC_RELEASE);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME,&deadline);
+    deadline.tv_sec+=LOG_DRAIN_MS/1000;
+    if (pthread_timedjoin_np(logbuf.thread,NULL,&deadline)==0) {
+        logbuf.running=0;
+    } else {
+        /* still stuck, what it hasn't written never will be */
+        logbuf.dropped+=logbuf.head-__atomic_load_n(&logbuf.tail,__ATOMIC_ACQUIRE);
+    }
+    if (logbuf.dropped) {
+        fprintf(stderr,"Echo: terminal too slow, %lu bytes dropped\n",logbuf.dropped);
+    }
+}
+
+/* start the logger, with every signal left for the main thread */
+static void log_start(void)
+{
+    fflush(log_stream());
+    logbuf.pid=getpid();
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK,&all,&old);
+    int rc=pthread_create(&logbuf.thread,NULL,log_thread,NULL);
+    pthread_sigmask(SIG_SETMASK,&old,NULL);
+    if (rc) {
+        /* echo straight to stdout, as ever */
+        return;
+    }
+    logbuf.running=1;
+    atexit(log_stop);
+}
+
+/* type one interactive character, echoing it locally with -vv/-vvv */
+static void send_user_char(int chr)
+{
+    /* send typed character to uinput device */
+    sendchar(chr);
+
+    /* verbose output? (very verbose!) */
+    if (verbose_mode>2) {
+        /* -vvv : show hex value of char */
+        char line[5]={ "0123456789abcdef"[chr/16], "0123456789abcdef"[chr%16], '\n' };
+        size_t len=3;
+        if (chr>' ') {
+            line[2]=' ';
+            line[3]=(char)chr;
+            line[4]='\n';
+            len=5;
+        }
+        log_write(line,len);
+    } else if (verbose_mode>1) {
+        /* -vv : echo char locally */
+        char echo=(char)chr;
+        log_write(&echo,1);
+    }
+}
+
+/* add a descriptor to the interactive epoll set, tagged with its source */
+static void watch_fd(int epfd, int fd, unsigned int source)
+{
+    struct epoll_event ev;
+    memset(&ev,0,sizeof(ev));
+    ev.events=EPOLLIN;
+    ev.data.u32=source;
+    if (epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev)) {
+        error(EXIT_FAILURE,errno,"Unable to watch input");
+        /* no return */
+    }
+}
+
+/* one mouse frame out, after whatever's been typed has let go */
+static void mouse_frame(const struct input_event* events, int count)
+{
+    if (out.evbuf_count+count+OPT_STROKE_EVENTS>EVBUF_MAX) {
+        flush_events(&out);
+    }
+    opt_settle(&out);
+    queue_frame(&out, events, count);
+}
+
+/* send the motion added up so far, as a single frame */
+static void mouse_report(void)
+{
+    struct input_event events[sizeof(mouse_axes)/sizeof(mouse_axes[0])+1];
+    int count=0;
+
+    if (!mouse.moved) {
+        return;
+    }
+    for (unsigned int i=0; i<sizeof(mouse_axes)/sizeof(mouse_axes[0]); i++) {
+        if (mouse.rel[i]) {
+            put_event(&events[count++], EV_REL, mouse_axes[i], mouse.rel[i]);
+            mouse.rel[i]=0;
+        }
+    }
+    mouse.moved=0;
+    if (count) {
+        put_event(&events[count++], EV_SYN, SYN_REPORT, 0);
+        mouse_frame(events, count);
+        mouse.reports++;
+    }
+    mouse.due=now_ns()+1000000000LL/mouse_rate;
+}
+
+/* motion along mouse_axes[axis], reported when it's next due */
+static void mouse_move(int axis, int delta)
+{
+    mouse.rel[axis]+=delta;
+    mouse.moved=1;
+    mouse.motions++;
+}
+
+/* buttons don't wait, but motion before them goes first */
+static void mouse_button(unsigned short code, int value)
+{
+    struct input_event events[2];
+
+    mouse_report();
+    put_event(&events[0], EV_KEY, code, value);
+    put_event(&events[1], EV_SYN, SYN_REPORT, 0);
+    mouse_frame(events, 2);
+    mouse.clicks++;
+}
+
+/* An xterm SGR mouse report: button number (+32 motion, +64 wheel, */
+/* +4/8/16 shift/meta/ctrl), and the 1-based cell it happened in.  */
+/* Cells become motion relative to the last one seen.              */
+static void mouse_sgr(int button, int col, int row, int press)
+{
+    static const unsigned short buttons[]={ BTN_LEFT, BTN_MIDDLE, BTN_RIGHT };
+
+    if ((mouse.col)&&(col)&&(row)) {
+        if (col!=mouse.col) {
+            mouse_move(0, (col-mouse.col)*MOUSE_CELL_X);
+        }
+        if (row!=mouse.row) {
+            mouse_move(1, (row-mouse.row)*MOUSE_CELL_Y);
+        }
+    }
+    if ((col)&&(row)) {
+        mouse.col=col;
+        mouse.row=row;
+    }
+
+    if (button&64) {
+        /* wheel: up, down, left, right, presses only */
+        if (press) {
+            int b=button&3;
+            mouse_move((b<2)?2:3, ((b==0)||(b==3))?1:-1);
+        }
+    } else if (((button&32)==0)&&((button&3)<3)) {
+        mouse_button(buttons[button&3], press);
+    }
+}
+
+/* pass along what the grabbed mouse has to say: motion and wheel are */
+/* added up, buttons go as they are, and its own frames are dropped   */
+static int mouse_read(void)
+{
+    struct input_event events[64];
+    ssize_t num_read;
+
+    while ((num_read=read(mouse.fd, events, sizeof(events)))>0) {
+        for (int i=0; i<(int)(num_read/(ssize_t)sizeof(events[0])); i++) {
+            if (events[i].type==EV_REL) {
+                for (int a=0; a<(int)(sizeof(mouse_axes)/sizeof(mouse_axes[0])); a++) {
+                    if (events[i].code==mouse_axes[a]) {
+                        mouse_move(a, events[i].value);
+                    }
+                }
+            } else if ((events[i].type==EV_KEY)&&(events[i].code>=BTN_MOUSE)&&(events[i].code<=BTN_TASK)&&(events[i].value<2)) {
+                mouse_button(events[i].code, events[i].value);
+            }
+        }
+    }
+    /* unplugged, most likely */
+    if ((num_read==0)||((errno!=EAGAIN)&&(errno!=EINTR))) {
+        return -1;
+    }
+    return 0;
+}
+
+/* the grabbed mouse is gone: let go of anything it was holding, */
+/* and carry on without it                                       */
+static void mouse_gone(int epfd)
+{
+    error(0, errno, "Lost mouse '%s', carrying on without it", mouse_source);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, mouse.fd, NULL);
+    close(mouse.fd);
+    mouse.fd=-1;
+
+    struct input_event events[BTN_TASK-BTN_MOUSE+2];
+    int count=0;
+    for (unsigned short code=BTN_MOUSE; code<=BTN_TASK; code++) {
+        put_event(&events[count++], EV_KEY, code, 0);
+    }
+    put_event(&events[count++], EV_SYN, SYN_REPORT, 0);
+    mouse_report();
+    mouse_frame(events, count);
+}
+
+/* stop the terminal reporting mouse moves, on any exit */
+static void mouse_tty_reset(void)
+{
+    if (mouse.reporting) {
+        fputs("\x1b[?1006l\x1b[?1003l",log_stream());
+        fflush(log_stream());
+        mouse.reporting=0;
+    }
+}
+
+/* start listening to the mouse: ask the terminal for reports of every */
+/* move in SGR form, or take the local mouse away from everyone else  */
+static void mouse_open(void)
+{
+    mouse.col=0;
+    mouse.row=0;
+    mouse.due=0;
+    if (strcmp(mouse_source,"tty")==0) {
+        static int registered=0;
+        if (!registered) {
+            atexit(mouse_tty_reset);
+            registered=1;
+        }
+        fputs("\x1b[?1003h\x1b[?1006h",log_stream());
+        fflush(log_stream());
+        mouse.reporting=1;
+        return;
+    }
+    mouse.fd=open(mouse_source,O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+    if (mouse.fd<0) {
+        error(EXIT_FAILURE,errno,"Unable to open mouse: '%s'",mouse_source);
+        /* no return */
+    }
+    if (ioctl(mouse.fd,EVIOCGRAB,1)) {
+        error(EXIT_FAILURE,errno,"Unable to grab mouse: '%s'",mouse_source);
+        /* no return */
+    }
+}
+
+/* and give it back */
+static void mouse_close(void)
+{
+    mouse_report();
+    mouse_tty_reset();
+    if (mouse.fd<0) {
+        return;
+    }
+    ioctl(mouse.fd,EVIOCGRAB,0);
+    close(mouse.fd);
+    mouse.fd=-1;
+}
+
+/* motion waiting? report it now if it's due, else have the timer */
+/* wake us when it is                                             */
+static void mouse_due(int timerfd)
+{
+    if (!mouse.moved) {
+        return;
+    }
+    if ((now_ns()>=mouse.due)||(timerfd<0)) {
+        mouse_report();
+        return;
+    }
+    struct itimerspec its;
+    memset(&its,0,sizeof(its));
+    its.it_value.tv_sec=(time_t)(mouse.due/1000000000LL);
+    its.it_value.tv_nsec=(long)(mouse.due%1000000000LL);
+    timerfd_settime(timerfd,TFD_TIMER_ABSTIME,&its,NULL);
+}
+
+/* which key a finished sequence stands for, 0 if none we know */
+static uint16_t vt_key(const vt_decoder* vt, int chr)
+{
+    uint16_t key=0;
+    int mods=0;
+
+    if (vt->priv) {
+        /* private or intermediate bytes, mouse reports and the like */
+        return 0;
+    }
+    switch (vt->state) {
+        case VT_LINUX: /* ESC [ [ A-E, linux console F1-F5 */
+            if ((chr>='A')&&(chr<='E')) {
+                key=vt_linux[chr-'A'];
+            }
+            break;
+        case VT_SS3: /* ESC O x, maybe with the modifier first */
+            key=vt_ss3_only[chr&0x7f]?vt_ss3_only[chr&0x7f]:vt_final[chr&0x7f];
+            mods=vt->params[0];
+            break;
+        case VT_CSI:
+            if (chr=='~') {
+                /* ESC [ n ; m ~ */
+                if (vt->params[0]<(int)(sizeof(vt_tilde)/sizeof(vt_tilde[0]))) {
+                    key=vt_tilde[vt->params[0]];
+                }
+            } else {
+                /* ESC [ 1 ; m x */
+                key=vt_final[chr&0x7f];
+            }
+            mods=vt->params[1];
+            break;
+    }
+
+    /* xterm modifiers are 1 + shift(1) | alt(2) | ctrl(4) */
+    if ((key)&&(mods>1)) {
+        mods--;
+        key|=(uint16_t)(((mods&1)?US:0)|((mods&2)?UA:0)|((mods&4)?UC:0));
+    }
+    return key;
+}
+
+/* a decoded key, tagged so nothing typed can pass for one */
+static size_t vt_stroke(uint16_t stroke, char* out)
+{
+    out[0]=(char)STROKE_TAG;
+    memcpy(out+1,&stroke,sizeof(stroke));
+    return STROKE_TAG_SIZE;
+}
+
+/* Feed bytes from the terminal through the escape sequence decoder,   */
+/* appending what's to be typed to out: plain bytes as they are, keys  */
+/* as tagged strokes.  Constant work per byte.  Returns bytes written, */
+/* at most 2*len+VT_HOLD_MAX.                                          */
+static size_t vt_decode(vt_decoder* vt, const char* in, size_t len, char* out)
+{
+    size_t num=0;
+
+    for (size_t i=0; i<len; i++) {
+        int chr=(unsigned char)in[i];
+        int cell=vt_next[vt->state][vt_class[chr]];
+
+        switch (cell&0x0f) {
+            case VA_TYPE:
+                out[num++]=(char)((chr==STROKE_TAG)?0xf8:chr);
+                break;
+            case VA_START:
+                vt->held_count=0;
+                vt->deadline=now_ns()+(long long)VT_TIMEOUT*1000000LL;
+                break;
+            case VA_ALT: {
+                /* ESC then a key is that key with ALT held, if it's one stroke */
+                uint32_t entry=layout_entry(layout,(uint32_t)chr);
+                if ((entry>>24)==1) {
+                    num+=vt_stroke((uint16_t)(layout_strokes(layout,entry)[0]|UA),out+num);
+                } else {
+                    out[num++]=0x1b;
+                    out[num++]=(char)chr;
+                }
+                break;
+            }
+            case VA_INTRO:
+                vt->params[0]=0;
+                vt->params[1]=0;
+                vt->params[2]=0;
+                vt->param_count=0;
+                vt->priv=0;
+                break;
+            case VA_DIGIT:
+                if ((vt->param_count<3)&&(vt->params[vt->param_count]<10000)) {
+                    vt->params[vt->param_count]=vt->params[vt->param_count]*10+(chr-'0');
+                }
+                break;
+            case VA_SEMI:
+                vt->param_count++;
+                break;
+            case VA_PRIV:
+                if (vt->priv==0) {
+                    vt->priv=chr;
+                }
+                break;
+            case VA_KEY: {
+                /* ESC [ M b x y, an X10 mouse report, not a key */
+                if ((vt->state==VT_CSI)&&(chr=='M')&&(vt->param_count==0)&&(vt->params[0]==0)&&(!vt->priv)) {
+                    vt->skip=VT_X10_BYTES;
+                    cell=VT(VT_X10,VA_SKIP);
+                    break;
+                }
+                /* ESC [ < b ; col ; row M (press) or m (release) */
+                if ((vt->priv=='<')&&((chr=='M')||(chr=='m'))&&(mouse_source)) {
+                    mouse_sgr(vt->params[0],vt->params[1],vt->params[2],chr=='M');
+                }
+                /* sequences we don't know are swallowed, not typed as junk */
+                uint16_t key=vt_key(vt,chr);
+                if (key) {
+                    num+=vt_stroke(key,out+num);
+                }
+                break;
+            }
+            case VA_SKIP:
+                if (--vt->skip==0) {
+                    cell=VT(VT_GROUND,VA_SKIP);
+                }
+                break;
+            case VA_ABORT:
+                /* not a sequence after all: type what we held, then */
+                /* start over with this byte                          */
+                out[num++]=0x1b;
+                memcpy(out+num,vt->held,(size_t)vt->held_count);
+                num+=(size_t)vt->held_count;
+                vt->state=VT_GROUND;
+                vt->held_count=0;
+                i--;
+                continue;
+        }
+
+        vt->state=cell>>4;
+        if (vt->state!=VT_GROUND) {
+            if ((cell&0x0f)!=VA_START) {
+                vt->held[vt->held_count++]=(char)chr;
+            }
+            if (vt->held_count==VT_HOLD_MAX) {
+                /* far too long for anything we know, forget it */
+                vt->state=VT_GROUND;
+                vt->held_count=0;
+            }
+        }
+    }
+    return num;
+}
+
+/* nothing more arrived in time: a lone ESC is just ESC, and the start */
+/* of a sequence which never finished is typed as it is               */
+static size_t vt_expire(vt_decoder* vt, char* out)
+{
+    if ((vt->state==VT_GROUND)||(now_ns()<vt->deadline)) {
+        return 0;
+    }
+    if (vt->state==VT_X10) {
+        /* the rest of a mouse report, never mind */
+        vt->state=VT_GROUND;
+        vt->held_count=0;
+        return 0;
+    }
+    out[0]=0x1b;
+    memcpy(out+1,vt->held,(size_t)vt->held_count);
+    size_t num=1+(size_t)vt->held_count;
+    vt->state=VT_GROUND;
+    vt->held_count=0;
+    return num;
+}
+
+static void connect_user(int escape_char)
+{
+    /* typed bytes waiting for their turn to be sent */
+    static char pending[PENDING_MAX];
+    size_t pending_start=0;
+    size_t pending_len=0;
+
+    /* set input to nonblocking/raw mode */
+    set_keyboard(KBD_MODE_RAW);
+
+    /* state machine to find escape sequence */
+    int escape_sequence_state=0;
+
+    /* and the one turning terminal key sequences into keys */
+    vt_decoder vt;
+    memset(&vt,0,sizeof(vt));
+
+    int epfd=epoll_create1(EPOLL_CLOEXEC);
+    if (epfd<0) {
+        error(EXIT_FAILURE,errno,"Unable to create epoll set");
+        /* no return */
+    }
+
+    /* listen for stdin */
+    watch_fd(epfd,0,SRC_STDIN);
+    int stdin_watched=1;
+
+    /* signals arrive as data too, rather than interrupting us */
+    sigset_t sigs, oldsigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs,SIGINT);
+    sigaddset(&sigs,SIGTERM);
+    sigaddset(&sigs,SIGHUP);
+    sigprocmask(SIG_BLOCK,&sigs,&oldsigs);
+    int sigfd=signalfd(-1,&sigs,SFD_NONBLOCK|SFD_CLOEXEC);
+    if (sigfd>=0) {
+        watch_fd(epfd,sigfd,SRC_SIGNAL);
+    }
+
+    /* timer wakes us when the pacing schedule says the next one's due */
+    int timerfd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+    if (timerfd>=0) {
+        watch_fd(epfd,timerfd,SRC_TIMER);
+    }
+
+    /* anything written to the control FIFO gets typed as well. Opened */
+    /* read/write so it never sees EOF when a writer goes away.        */
+    int ctlfd=-1;
+    if (control_fifo) {
+        ctlfd=open(control_fifo,O_RDWR|O_NONBLOCK|O_CLOEXEC);
+        if (ctlfd<0) {
+            error(0,errno,"Unable to open control FIFO '%s'",control_fifo);
+        } else {
+            watch_fd(epfd,ctlfd,SRC_CONTROL);
+        }
+    }
+
+    /* the mouse, its own or the terminal's, and a timer for reporting */
+    /* motion no more often than asked                                 */
+    int motionfd=-1;
+    if (mouse_source) {
+        mouse_open();
+        if (mouse.fd>=0) {
+            watch_fd(epfd,mouse.fd,SRC_MOUSE);
+        }
+        motionfd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+        if (motionfd>=0) {
+            watch_fd(epfd,motionfd,SRC_MOTION);
+        }
+    }
+
+    int done=0;
+    int leaving=0;
+    while (!leaving) {
+        /* on the way out, whatever is already due still goes */
+        leaving=done;
+
+        /* waited long enough for the rest of an escape sequence? */
+        if ((vt.state!=VT_GROUND)&&(pending_start+pending_len+VT_HOLD_MAX<=PENDING_MAX)) {
+            pending_len+=vt_expire(&vt,pending+pending_start+pending_len);
+        }
+
+        /* type whatever is due, then arm the timer for the rest */
+        while (pending_len) {
+            long long due=pace_due();
+            if ((due)&&(due>now_ns())&&(timerfd>=0)) {
+                struct itimerspec its;
+                memset(&its,0,sizeof(its));
+                its.it_value.tv_sec=(time_t)(due/1000000000LL);
+                its.it_value.tv_nsec=(long)(due%1000000000LL);
+                timerfd_settime(timerfd,TFD_TIMER_ABSTIME,&its,NULL);
+                break;
+            }
+            if ((unsigned char)pending[pending_start]==STROKE_TAG) {
+                uint16_t stroke;
+                memcpy(&stroke,pending+pending_start+1,sizeof(stroke));
+                send_stroke(stroke);
+                pending_start+=STROKE_TAG_SIZE;
+                pending_len-=STROKE_TAG_SIZE;
+                continue;
+            }
+            send_user_char((unsigned char)pending[pending_start]);
+            pending_start++;
+            pending_len--;
+        }
+        if (pending_len==0) {
+            pending_start=0;
+            pace_idle();
+        }
+
+        /* mouse motion goes once it's due */
+        if (mouse_source) {
+            mouse_due(motionfd);
+        }
+
+        /* everything sent so far goes out together */
+        flush_events(&out);
+        fflush(log_stream());
+        if (leaving) {
+            break;
+        }
+
+        /* stop reading while there's nowhere to put it */
+        int want_stdin=(pending_len<PENDING_MAX);
+        if (want_stdin!=stdin_watched) {
+            struct epoll_event ev;
+            memset(&ev,0,sizeof(ev));
+            ev.events=want_stdin?EPOLLIN:0;
+            ev.data.u32=SRC_STDIN;
+            epoll_ctl(epfd,EPOLL_CTL_MOD,0,&ev);
+            stdin_watched=want_stdin;
+        }
+
+        /* half an escape sequence in hand? don't wait forever for the rest */
+        if (stats_pending) {
+            stats_service();
+        }
+
+        int timeout=-1;
+        if (vt.state!=VT_GROUND) {
+            long long left=vt.deadline-now_ns();
+            timeout=(left>0)?(int)((left+999999)/1000000):0;
+        }
+
+        struct epoll_event events[4];
+        int num_events=epoll_wait(epfd,events,4,timeout);
+        if (num_events<0) {
+            if (errno==EINTR) {
+                continue;
+            }
+            /* something bad happened */
+            perror("Error during epoll_wait");
+            break;
+        }
+
+        for (int i=0; (i<num_events)&&(!done); i++) {
+            /* keep pending contiguous, there's always room at the front */
+            if (pending_start+pending_len==PENDING_MAX) {
+                memmove(pending,pending+pending_start,pending_len);
+                pending_start=0;
+            }
+            char* tail=pending+pending_start+pending_len;
+            size_t room=PENDING_MAX-pending_start-pending_len;
+
+            switch (events[i].data.u32) {
+                case SRC_STDIN: {
+                    /* decoded keys can take up more room than their bytes */
+                    static char input[PENDING_MAX/2];
+                    if (room<=VT_HOLD_MAX) {
+                        break;
+                    }
+                    long long t0=now_ns();
+                    ssize_t num_read=read(0,input,(room-VT_HOLD_MAX)/2);
+                    if ((num_read<0)&&((errno==EAGAIN)||(errno==EINTR))) {
+                        break;
+                    }
+                    if (num_read<=0) {
+                        /* terminal went away, nothing more to type */
+                        done=1;
+                        break;
+                    }
+                    stage_add(STAGE_READ,t0);
+                    stat_reads++;
+                    stat_bytes+=(size_t)num_read;
+                    t0=now_ns();
+
+                    /* state machine to handle escape code, whole buffer at once */
+                    for (ssize_t j=0; j<num_read; j++) {
+                        int chr=(unsigned char)input[j];
+                        switch (escape_sequence_state) {
+                            case 2: /* 2 = looking for period */
+                                escape_sequence_state=(chr=='.')?3:0;
+                                break;
+                            case 1: /* 1 = looking for escape_char */
+                                escape_sequence_state=(chr==escape_char)?2:0;
+                                break;
+                            default: /* 0 = looking for CR */
+                                escape_sequence_state=(chr==13)?1:0;
+                                break;
+                        }
+                        if (escape_sequence_state==3) {
+                            /* the '.' and anything after it never go out */
+                            num_read=j;
+                            done=1;
+                            break;
+                        }
+                    }
+                    pending_len+=vt_decode(&vt,input,(size_t)num_read,tail);
+                    stage_add(STAGE_ESCAPE,t0);
+                    break;
+                }
+                case SRC_CONTROL: {
+                    long long t0=now_ns();
+                    ssize_t num_read=read(ctlfd,tail,room);
+                    if (num_read>0) {
+                        /* it's text, whatever it holds */
+                        for (ssize_t j=0; j<num_read; j++) {
+                            if ((unsigned char)tail[j]==STROKE_TAG) {
+                                tail[j]=(char)0xf8;
+                            }
+                        }
+                        stage_add(STAGE_READ,t0);
+                        stat_reads++;
+                        stat_bytes+=(size_t)num_read;
+                        pending_len+=(size_t)num_read;
+                    }
+                    break;
+                }
+                case SRC_TIMER: {
+                    uint64_t expirations;
+                    ssize_t ignored=read(timerfd,&expirations,sizeof(expirations));
+                    (void)ignored;
+                    break;
+                }
+                case SRC_MOUSE:
+                    if ((mouse.fd>=0)&&(mouse_read())) {
+                        mouse_gone(epfd);
+                    }
+                    break;
+                case SRC_MOTION: {
+                    uint64_t expirations;
+                    ssize_t ignored=read(motionfd,&expirations,sizeof(expirations));
+                    (void)ignored;
+                    break;
+                }
+                case SRC_SIGNAL: {
+                    struct signalfd_siginfo info;
+                    if (read(sigfd,&info,sizeof(info))==sizeof(info)) {
+                        abort_requested=1;
+                        done=1;
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    }
+
+    /* escape typed while pacing? then whatever was still waiting is dropped */
+    if ((pending_len)&&(verbose_mode)) {
+        fprintf(stderr,"Dropped %u unsent characters\n",(unsigned int)pending_len);
+    }
+    if (mouse_source) {
+        mouse_close();
+        if (motionfd>=0) {
+            close(motionfd);
+        }
+        if (verbose_mode) {
+            fprintf(stderr,"Mouse: %lu moves in, %lu motion reports and %lu button changes out\n",
+                    mouse.motions,mouse.reports,mouse.clicks);
+        }
+    }
+    flush_events(&out);
+
+    if (ctlfd>=0) {
+        close(ctlfd);
+    }
+    if (timerfd>=0) {
+        close(timerfd);
+    }
+    if (sigfd>=0) {
+        close(sigfd);
+    }
+    close(epfd);
+    sigprocmask(SIG_SETMASK,&oldsigs,NULL);
+
+    /* set input to 'normal' mode */
+    set_keyboard(KBD_MODE_NORMAL);
+}
+
+/* monotonic clock in seconds, for throughput reports */
+static double now_seconds(void)
+{
+    return (double)now_ns()/1e9;
+}
+
+/* Adaptive rate, -A.  Slow consumers (getty, a busy shell, a serial   */
+/* console) drop keys when typed at too fast, so text is typed a line   */
+/* at a time and read back before the line's Enter goes: from the       */
+/* screen, /dev/vcsaN (the cells just before the cursor), or from an    */
+/* echo stream, a pty or FIFO carrying what the target echoed.  A line  */
+/* that landed nudges the rate up by ADAPT_STEP, one that didn't halves */
+/* it, and is rubbed out (backspace, as many as landed) and typed again. */
+/* Lines with anything but printable ASCII, or which echo nothing at    */
+/* all (passwords), can't be checked and are only counted.              */
+#define ADAPT_START 100
+#define ADAPT_MIN 5
+#define ADAPT_MAX 5000
+#define ADAPT_STEP 25
+#define ADAPT_RETRIES 3
+#define ADAPT_SETTLE_MS 300
+#define ADAPT_QUIET_MS 30
+#define ADAPT_WAIT_MS 5000
+#define ADAPT_POLL_MS 5
+#define ADAPT_LINE_MAX 1024
+enum { ADAPT_MATCH, ADAPT_WRONG, ADAPT_SILENT };
+typedef struct {
+    int fd;
+    int screen;
+    double rate;
+    double rate_low;
+    /* the line being gathered, and how many we've seen */
+    char line[ADAPT_LINE_MAX];
+    size_t len;
+    unsigned long lines;
+    unsigned long retyped;
+    unsigned long unverified;
+    /* screen: header (rows, cols, cursor x, y) then char/attr cells, */
+    /* and where the cursor was when the line started                 */
+    unsigned char cells[4+256*256*2];
+    long cursor_start;
+    /* echo stream: printable characters echoed since the line started */
+    char echo[ADAPT_LINE_MAX*2];
+    size_t echo_len;
+    int echo_esc;
+} adaptive;
+static adaptive adapt={ .fd=-1 };
+static const char* adapt_source=NULL;
+
+/* start reading back: 'pty' makes a stand-in and says where it is, */
+/* /dev/vcsN means its vcsaN (which has the cursor), anything else  */
+/* is read as an echo stream                                         */
+static void adapt_open(const char* source)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", source);
+    if (strcmp(source, "pty")==0) {
+        adapt.fd=posix_openpt(O_RDWR|O_NOCTTY|O_NONBLOCK|O_CLOEXEC);
+        if ((adapt.fd<0)||(grantpt(adapt.fd))||(unlockpt(adapt.fd))) {
+            error(EXIT_FAILURE, errno, "Unable to create readback pty");
+            /* no return */
+        }
+        fprintf(stderr, "Adaptive: write what landed to %s\n", ptsname(adapt.fd));
+    } else {
+        if ((strncmp(source, "/dev/vcs", 8)==0)&&(source[8]>='0')&&(source[8]<='9')) {
+            snprintf(path, sizeof(path), "/dev/vcsa%s", source+8);
+        }
+        adapt.screen=(strncmp(path, "/dev/vcsa", 9)==0);
+        adapt.fd=open(path, O_RDONLY|O_CLOEXEC|(adapt.screen?0:O_NONBLOCK));
+        if (adapt.fd<0) {
+            error(EXIT_FAILURE, errno, "Unable to read back from '%s'", path);
+            /* no return */
+        }
+    }
+    /* -p is where it starts, else somewhere cautious */
+    adapt.rate=(pace.gap>0)?1e9/(double)pace.gap:ADAPT_START;
+    adapt.rate_low=adapt.rate;
+}
+
+/* take in whatever's been echoed, minus escape sequences */
+static void adapt_drain(void)
+{
+    unsigned char buffer[4096];
+    ssize_t num_read;
+    while ((num_read=read(adapt.fd, buffer, sizeof(buffer)))>0) {
+        for (ssize_t i=0; i<num_read; i++) {
+            unsigned char chr=buffer[i];
+            if (adapt.echo_esc) {
+                /* ESC x, or ESC [ ... final */
+                adapt.echo_esc=((adapt.echo_esc==1)&&(chr=='['))?2:
+                               ((adapt.echo_esc==2)&&((chr<0x40)||(chr>0x7e)))?2:0;
+            } else if (chr==0x1b) {
+                adapt.echo_esc=1;
+            } else if (((chr==0x08)||(chr==0x7f))&&(adapt.echo_len)) {
+                adapt.echo_len--;
+            } else if ((chr>=0x20)&&(chr<0x7f)) {
+                if (adapt.echo_len==sizeof(adapt.echo)) {
+                    /* only the end is ever looked at */
+                    memmove(adapt.echo, adapt.echo+ADAPT_LINE_MAX, ADAPT_LINE_MAX);
+                    adapt.echo_len-=ADAPT_LINE_MAX;
+                }
+                adapt.echo[adapt.echo_len++]=(char)chr;
+            }
+        }
+    }
+}
+
+/* the cursor, as a cell number, after a fresh look at the screen */
+static long adapt_screen(void)
+{
+    if (pread(adapt.fd, adapt.cells, sizeof(adapt.cells), 0)<4) {
+        error(EXIT_FAILURE, errno, "Unable to read back the screen");
+        /* no return */
+    }
+    return (long)adapt.cells[3]*adapt.cells[1]+adapt.cells[2];
+}
+
+/* get everything typed so far out to the target */
+static void adapt_flush(void)
+{
+    flush_events(&out);
+    if (uring.fd>=0) {
+        uring_submit(URING_IDLE);
+    }
+}
+
+/* note where things stand before a line is typed, once the last  */
+/* line's Enter (and whatever it brought, a prompt or a scroll) has */
+/* stopped moving things                                            */
+static void adapt_mark(void)
+{
+    adapt_flush();
+    long long start=now_ns();
+    long long quiet=start;
+    long last=-1;
+    while (1) {
+        long progress;
+        if (adapt.screen) {
+            progress=adapt.cursor_start=adapt_screen();
+        } else {
+            adapt_drain();
+            progress=(long)adapt.echo_len;
+        }
+        long long now=now_ns();
+        if (progress!=last) {
+            last=progress;
+            quiet=now;
+        }
+        if ((abort_requested)||(now-quiet>ADAPT_QUIET_MS*1000000LL)||
+            (now-start>ADAPT_SETTLE_MS*1000000LL)) {
+            break;
+        }
+        struct timespec ts={ 0, ADAPT_POLL_MS*1000000L };
+        nanosleep(&ts, NULL);
+    }
+    adapt.echo_len=0;
+}
+
+/* did the line land?  *landed is how much has (for rubbing out), and */
+/* *progress changes whenever anything more turns up.  With no line,   */
+/* it's whether what landed has all been rubbed out.                   */
+static int adapt_look(const char* line, size_t len, size_t* landed, long* progress)
+{
+    if (adapt.screen) {
+        long cursor=adapt_screen();
+        long moved=cursor-adapt.cursor_start;
+        *progress=cursor;
+        /* scrolled, so no telling: assume it all went */
+        *landed=(moved<0)?len:((size_t)moved<len)||(line==NULL)?(size_t)moved:len;
+        if (line==NULL) {
+            return (*landed==0)?ADAPT_MATCH:ADAPT_WRONG;
+        }
+        size_t span=((long)len<cursor)?len:(size_t)cursor;
+        const unsigned char* cell=adapt.cells+4+2*(cursor-(long)span);
+        size_t i=0;
+        while ((i<span)&&(cell[2*i]==(unsigned char)line[len-span+i])) {
+            i++;
+        }
+        if (i==span) {
+            return ADAPT_MATCH;
+        }
+        return (moved==0)?ADAPT_SILENT:ADAPT_WRONG;
+    }
+
+    adapt_drain();
+    *progress=(long)adapt.echo_len;
+    *landed=((adapt.echo_len<len)||(line==NULL))?adapt.echo_len:len;
+    if (line==NULL) {
+        return (*landed==0)?ADAPT_MATCH:ADAPT_WRONG;
+    }
+    if ((adapt.echo_len>=len)&&(memcmp(adapt.echo+adapt.echo_len-len, line, len)==0)) {
+        return ADAPT_MATCH;
+    }
+    return (adapt.echo_len==0)?ADAPT_SILENT:ADAPT_WRONG;
+}
+
+/* give the target time to catch up, for as long as it's still moving */
+static int adapt_verify(const char* line, size_t len, size_t* landed)
+{
+    adapt_flush();
+    long long start=now_ns();
+    long long quiet=start;
+    long last=-1;
+    while (1) {
+        long progress;
+        int result=adapt_look(line, len, landed, &progress);
+        long long now=now_ns();
+        if (progress!=last) {
+            last=progress;
+            quiet=now;
+        }
+        if ((result==ADAPT_MATCH)||(abort_requested)||
+            (now-quiet>ADAPT_SETTLE_MS*1000000LL)||(now-start>ADAPT_WAIT_MS*1000000LL)) {
+            return result;
+        }
+        struct timespec ts={ 0, ADAPT_POLL_MS*1000000L };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* take back what landed, at the (already lowered) rate, until it's gone */
+static void adapt_rubout(size_t landed)
+{
+    pace.gap=(long long)(1e9/adapt.rate);
+    for (int tries=0; (landed)&&(tries<=ADAPT_RETRIES)&&(!abort_requested); tries++) {
+        for (size_t i=0; i<landed; i++) {
+            send_stroke(KEY_BACKSPACE);
+        }
+        adapt_verify(NULL, 0, &landed);
+        pace_idle();
+    }
+}
+
+/* type the gathered line until it lands, adjusting the rate as we go */
+static void adapt_line(void)
+{
+    const char* line=adapt.line;
+    size_t len=adapt.len;
+    adapt.len=0;
+    if (len==0) {
+        return;
+    }
+    adapt.lines++;
+
+    int checkable=1;
+    for (size_t i=0; i<len; i++) {
+        checkable&=((line[i]>=0x20)&&(line[i]<0x7f));
+    }
+
+    for (int tries=0; !abort_requested; tries++) {
+        pace.gap=(long long)(1e9/adapt.rate);
+        adapt_mark();
+        for (size_t i=0; (i<len)&&(!abort_requested); i++) {
+            sendchar(line[i]);
+        }
+        if (!checkable) {
+            adapt.unverified++;
+            return;
+        }
+
+        size_t landed=0;
+        int result=adapt_verify(line, len, &landed);
+        pace_idle();
+        if (result==ADAPT_MATCH) {
+            adapt.rate=(adapt.rate+ADAPT_STEP<ADAPT_MAX)?adapt.rate+ADAPT_STEP:ADAPT_MAX;
+            return;
+        }
+        if ((result==ADAPT_SILENT)||(abort_requested)) {
+            adapt.unverified++;
+            return;
+        }
+
+        /* too fast for it: back off, rub out what did land, go again */
+        adapt.rate=(adapt.rate/2>ADAPT_MIN)?adapt.rate/2:ADAPT_MIN;
+        if (adapt.rate<adapt.rate_low) {
+            adapt.rate_low=adapt.rate;
+        }
+        if (tries==ADAPT_RETRIES) {
+            error(EXIT_FAILURE, 0, "Line %lu still not landing after %d tries, stopping", adapt.lines, tries+1);
+            /* no return */
+        }
+        adapt.retyped++;
+        if (verbose_mode) {
+            fprintf(stderr, "Line %lu didn't land, retyping at %.0f chars/sec\n", adapt.lines, adapt.rate);
+        }
+        adapt_rubout(landed);
+    }
+}
+
+/* gather text into lines, each typed and checked before its Enter */
+static void adapt_feed(const char* buffer, size_t len)
+{
+    for (size_t i=0; (i<len)&&(!abort_requested); i++) {
+        char chr=buffer[i];
+        if ((chr=='\n')||(chr=='\r')) {
+            adapt_line();
+            sendchar(chr);
+        } else {
+            if (adapt.len==ADAPT_LINE_MAX) {
+                /* a monster, it goes in pieces */
+                adapt_line();
+            }
+            adapt.line[adapt.len++]=chr;
+        }
+    }
+}
+
+/* show what a file or string send cost us */
+static void report_send(const char* what, unsigned long chars, unsigned long events, unsigned long writes, double elapsed)
+{
+    if (verbose_mode==0) {
+        return;
+    }
+    if (elapsed<=0) {
+        elapsed=1e-9;
+    }
+    fprintf(stderr,"%s: %lu chars, %lu events, %lu writes in %.3fs (%.0f chars/sec, %.2f events/char, %.2f writes/char)\n",
+            what,chars,events,writes,elapsed,(double)chars/elapsed,
+            chars?(double)events/(double)chars:0.0,chars?(double)writes/(double)chars:0.0);
+    if (stat_unmapped) {
+        fprintf(stderr,"Layout '%s' has no keys for %lu characters, skipped\n",layout->name,stat_unmapped);
+    }
+
+    fprintf(stderr,"Queue: deepest %d events, %lu partial writes, %lu stalls (%.3fms waiting)\n",
+            out.depth_max,out.partials,out.stalls,(double)out.stall_ns/1e6);
+
+    if (uring.fd>=0) {
+        fprintf(stderr,"io_uring: %lu writes, %lu reads in %lu system calls\n",
+                uring.writes,uring.reads_done,uring.enters);
+    }
+
+    if (adapt.fd>=0) {
+        fprintf(stderr,"Adaptive: %lu lines, %lu retyped, %lu unchecked, rate now %.0f chars/sec (lowest %.0f)\n",
+                adapt.lines,adapt.retyped,adapt.unverified,adapt.rate,adapt.rate_low);
+    }
+
+    if ((pace_active())&&(uring.fd>=0)) {
+        /* the kernel did the waiting, and doesn't say how late it was */
+        fprintf(stderr,"Pacing: target %.1f chars/sec, held back by io_uring timeouts, lateness not measured\n",
+                (pace.gap>0)?1e9/(double)pace.gap:0.0);
+    } else if (pace_active()) {
+        /* how well did we keep to the schedule? */
+        fprintf(stderr,"Pacing: target %.1f chars/sec, behind schedule %lu times, worst %.3fms, total drift %.3fms\n",
+                (pace.gap>0)?1e9/(double)pace.gap:0.0,pace.late_count,
+                (double)pace.late_max/1e6,(double)pace.late_total/1e6);
+    }
+}
+
+/* counters and per stage latencies, for SIGUSR1, -Q and exit */
+static void stats_dump(int fd)
+{
+    dprintf(fd,"uptime %.3fs: %lu chars, %lu reads, %lu bytes, %lu events, %lu writes, %lu unmapped, %lu stalls\n",
+            (double)(now_ns()-stats_epoch)/1e9,stat_chars,stat_reads,stat_bytes,
+            out.events,out.writes,stat_unmapped,out.stalls);
+    dprintf(fd,"%-10s %10s %10s %10s %10s %10s %10s %12s\n",
+            "stage","count","mean ns","p50","p90","p99","p99.9","max");
+    for (int i=0; i<STAGES; i++) {
+        const latency_hist* hist=&stage_ns[i];
+        if (hist->count==0) {
+            continue;
+        }
+        dprintf(fd,"%-10s %10lu %10lld %10lld %10lld %10lld %10lld %12lld\n",
+                stage_names[i],hist->count,hist->total/(long long)hist->count,
+                hist_percentile(hist,50),hist_percentile(hist,90),
+                hist_percentile(hist,99),hist_percentile(hist,99.9),hist->max);
+    }
+}
+
+/* SIGUSR1 wants a dump on stderr, SIGIO means someone's at the socket */
+static void stats_handler(int sig)
+{
+    if (sig==SIGUSR1) {
+        stats_signalled=1;
+    }
+    stats_pending=1;
+}
+
+/* answer whoever asked, from the main thread between writes */
+static void stats_service(void)
+{
+    stats_pending=0;
+    if (stats_signalled) {
+        stats_signalled=0;
+        stats_dump(2);
+    }
+    if (stats_listen>=0) {
+        int conn;
+        while ((conn=accept4(stats_listen,NULL,NULL,SOCK_CLOEXEC))>=0) {
+            stats_dump(conn);
+            close(conn);
+        }
+    }
+}
+
+static void stats_exit(void)
+{
+    /* a forked child failing to exec isn't us */
+    if (getpid()!=stats_pid) {
+        return;
+    }
+    if (stats_socket) {
+        unlink(stats_socket);
+    }
+    if ((verbose_mode)||(stats_socket)) {
+        stats_dump(2);
+    }
+}
+
+/* Start the clock, and ask to be told about SIGUSR1 and the socket.  */
+/* The handler just raises a flag and the dump happens on the main    */
+/* thread, in flush_events(), pace_wait() or connect_user(): it owns  */
+/* the counters, so nothing else needs a lock.  (The stream reader    */
+/* hands its read timings over with each chunk, the logger keeps no   */
+/* stats, and -N's workers keep their own and exit when done.)  A     */
+/* thread of its own would also make glibc take its slow paths on     */
+/* every write, even when nobody's asking.                            */
+static void stats_start(void)
+{
+    stats_epoch=now_ns();
+    stats_pid=getpid();
+
+    struct sigaction sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler=stats_handler;
+    sa.sa_flags=SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1,&sa,NULL);
+
+    if (stats_socket) {
+        struct sockaddr_un addr;
+        unix_address(&addr,stats_socket);
+        unlink(stats_socket);
+        stats_listen=socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+        if ((stats_listen<0)||(bind(stats_listen,(struct sockaddr*)&addr,sizeof(addr)))||(listen(stats_listen,4))) {
+            error(EXIT_FAILURE,errno,"Unable to listen on '%s'",stats_socket);
+            /* no return */
+        }
+        /* a connection raises SIGIO */
+        sigaction(SIGIO,&sa,NULL);
+        fcntl(stats_listen,F_SETOWN,getpid());
+        fcntl(stats_listen,F_SETFL,fcntl(stats_listen,F_GETFL)|O_ASYNC);
+    }
+    atexit(stats_exit);
+}
+
+/* length of the run of ASCII at the start of text, bytes below 0x80.    */
+/* With per character templates that's all a byte needs to go in bulk: */
+/* shifted and control characters cost the same, and CR/LF only matter  */
+/* when pacing, which goes a character at a time anyway.                */
+static size_t ascii_run_scalar(const char* text, size_t len)
+{
+    size_t pos=0;
+
+    /* eight at a time, any top bit set ends the run */
+    while (pos+8<=len) {
+        uint64_t word;
+        memcpy(&word,text+pos,sizeof(word));
+        if (word&0x8080808080808080ULL) {
+            break;
+        }
+        pos+=8;
+    }
+    while ((pos<len)&&(!(text[pos]&0x80))) {
+        pos++;
+    }
+    return pos;
+}
+
+#if defined(__SSE2__)
+/* sixteen at a time, movemask hands over the top bits */
+static size_t ascii_run_sse2(const char* text, size_t len)
+{
+    size_t pos=0;
+    while (pos+16<=len) {
+        unsigned int mask=(unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(text+pos)));
+        if (mask) {
+            return pos+(size_t)__builtin_ctz(mask);
+        }
+        pos+=16;
+    }
+    return pos+ascii_run_scalar(text+pos,len-pos);
+}
+
+/* thirty two at a time, when the cpu has it (checked in ascii_run) */
+__attribute__((target("avx2")))
+static size_t ascii_run_avx2(const char* text, size_t len)
+{
+    size_t pos=0;
+    while (pos+32<=len) {
+        unsigned int mask=(unsigned int)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(text+pos)));
+        if (mask) {
+            return pos+(size_t)__builtin_ctz(mask);
+        }
+        pos+=32;
+    }
+    return pos+ascii_run_sse2(text+pos,len-pos);
+}
+#elif defined(__ARM_NEON)
+/* sixteen at a time, finding the exact spot is left to the scalar loop */
+static size_t ascii_run_neon(const char* text, size_t len)
+{
+    size_t pos=0;
+    while (pos+16<=len) {
+        uint8x16_t bytes=vld1q_u8((const uint8_t*)text+pos);
+#if defined(__aarch64__)
+        if (vmaxvq_u8(bytes)&0x80) {
+            break;
+        }
+#else
+        uint8x8_t most=vpmax_u8(vget_low_u8(bytes),vget_high_u8(bytes));
+        most=vpmax_u8(most,most);
+        most=vpmax_u8(most,most);
+        most=vpmax_u8(most,most);
+        if (vget_lane_u8(most,0)&0x80) {
+            break;
+        }
+#endif
+        pos+=16;
+    }
+    return pos+ascii_run_scalar(text+pos,len-pos);
+}
+#endif
+
+/* which of the above we're using, for reports */
+static const char* ascii_run_name(void)
+{
+#if defined(__SSE2__)
+    return __builtin_cpu_supports("avx2")?"avx2":"sse2";
+#elif defined(__ARM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+/* the best run finder this cpu has */
+static size_t ascii_run(const char* text, size_t len)
+{
+#if defined(__SSE2__)
+    static int have_avx2=-1;
+    if (have_avx2<0) {
+        have_avx2=__builtin_cpu_supports("avx2");
+    }
+    return have_avx2?ascii_run_avx2(text,len):ascii_run_sse2(text,len);
+#elif defined(__ARM_NEON)
+    return ascii_run_neon(text,len);
+#else
+    return ascii_run_scalar(text,len);
+#endif
+}
+
+/* Type a run of ASCII straight from the templates, copying each one's */
+/* events onto the queue with none of the UTF-8, pacing or per call    */
+/* bookkeeping of sendchar().  Only for when nothing is pacing.        */
+static void queue_ascii(sink* snk, const char* text, size_t len)
+{
+    unsigned long chars=0;
+    unsigned long events=0;
+
+    /* anything half way through a UTF-8 sequence is cut short */
+    utf8_pending=0;
+
+    for (size_t i=0; i<len; i++) {
+        unsigned int chr=(unsigned char)text[i];
+        const keytemplate* tmpl=&templates[chr];
+        if ((tmpl->count==0)||(tmpl->codepoint!=chr)) {
+            /* first sight of it (or nothing types it), the long way round */
+            send_codepoint(chr);
+            continue;
+        }
+
+        if (snk->evbuf_count+tmpl->count>EVBUF_MAX) {
+            flush_events(snk);
+        }
+        struct input_event* dest=&snk->evbuf[snk->evbuf_count];
+        memcpy(dest, tmpl->events, (size_t)tmpl->count*sizeof(tmpl->events[0]));
+        if (timestamp_policy==TS_FRAME) {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            for (int e=0; e<tmpl->count; e++) {
+                dest[e].time=tv;
+            }
+        }
+        snk->evbuf_count+=tmpl->count;
+        events+=(unsigned long)tmpl->count;
+        chars++;
+
+        if (snk->evbuf_count>=batch_events) {
+            flush_events(snk);
+        }
+    }
+    snk->events+=events;
+    stat_chars+=chars;
+}
+
+/* type a run of bytes, echoing them with -vv */
+static void send_buffer(const char* buffer, size_t len)
+{
+    if (adapt.fd>=0) {
+        adapt_feed(buffer,len);
+        if (verbose_mode>1) {
+            log_write(buffer,len);
+        }
+        return;
+    }
+
+    int bulk=(bulk_enabled)&&(!pace_active())&&(!optimize_keys);
+
+    /* with io_uring, writes go over a batch at a time */
+    uring.deferred=1;
+    while ((len)&&(!abort_requested)) {
+        /* runs of ASCII go in bulk, shorter ones a byte at a time */
+        size_t run=1;
+        if (bulk) {
+            run=ascii_run(buffer,(len>BULK_MAX)?BULK_MAX:len);
+            if (run>=BULK_MIN) {
+                long long t0=((++stats_tick%STATS_SAMPLE)==0)?now_ns():0;
+                queue_ascii(&out,buffer,run);
+                if (t0) {
+                    hist_add(&stage_ns[STAGE_TRANSLATE], (now_ns()-t0)/(long long)run);
+                }
+            } else {
+                /* and whatever ended the run goes with them */
+                run=(run<len)?run+1:run;
+                for (size_t i=0; i<run; i++) {
+                    sendchar(buffer[i]);
+                }
+            }
+        } else {
+            sendchar(*buffer);
+        }
+        if (verbose_mode>1) {
+            log_write(buffer,run);
+        }
+        buffer+=run;
+        len-=run;
+    }
+    uring.deferred=0;
+    if (uring.queued) {
+        uring_submit(URING_NOWAIT);
+    }
+}
+
+static void connect_string(const char* sendstr)
+{
+    if (verbose_mode>0) {
+        log_printf("Sending string: %s\n",sendstr);
+    }
+
+    pace_reset();
+    unsigned long chars=stat_chars, events=out.events, writes=out.writes;
+    double start=now_seconds();
+
+    send_buffer(sendstr,strlen(sendstr));
+    adapt_line();
+    flush_events(&out);
+
+    report_send("String",stat_chars-chars,out.events-events,out.writes-writes,now_seconds()-start);
+}
+
+/* regular files are mapped this much at a time, keeps 32bit Pi's happy */
+#define MAP_WINDOW (64*1024*1024)
+
+/* pipes, FIFOs & stdin are read ahead in this many chunks of this size */
+#define STREAM_CHUNK (64*1024)
+#define STREAM_CHUNKS 8
+
+/* chunks handed from the reader thread to the injecting thread */
+typedef struct {
+    int fd;
+    char* data;
+    size_t len[STREAM_CHUNKS];
+    /* how long each read took, counted by the injecting thread, which */
+    /* owns the stats, as the chunk is taken                            */
+    long long read_ns[STREAM_CHUNKS];
+    /* head is next chunk to fill, tail is next chunk to send */
+    int head;
+    int tail;
+    int count;
+    int done;
+    int err;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} stream_ring;
+
+/* send a regular file by mapping it a window at a time.  The next   */
+/* window is prefetched while this one is typed, so we never wait on */
+/* the disk.                                                          */
+static void send_mapped(int fd, off_t size)
+{
+    off_t offset=0;
+    while (offset<size) {
+        size_t len=(size-offset>MAP_WINDOW)?MAP_WINDOW:(size_t)(size-offset);
+        long long t0=now_ns();
+        char* map=mmap(NULL,len,PROT_READ,MAP_PRIVATE,fd,offset);
+        if (map==MAP_FAILED) {
+            error(EXIT_FAILURE,errno,"Unable to map file");
+            /* no return */
+        }
+        madvise(map,len,MADV_SEQUENTIAL);
+        madvise(map,len,MADV_WILLNEED);
+        stage_add(STAGE_READ,t0);
+        stat_bytes+=len;
+
+        /* get the kernel reading the next window in the background */
+        if (offset+(off_t)len<size) {
+            posix_fadvise(fd,offset+(off_t)len,MAP_WINDOW,POSIX_FADV_WILLNEED);
+        }
+
+        send_buffer(map,len);
+        munmap(map,len);
+        offset+=(off_t)len;
+    }
+}
+
+/* cancellation cleanup, don't die holding the ring lock */
+static void unlock_mutex(void* lock)
+{
+    pthread_mutex_unlock(lock);
+}
+
+/* reader side of stream_ring, keeps chunks coming until EOF or error */
+static void* stream_reader(void* arg)
+{
+    stream_ring* ring=arg;
+
+    while (1) {
+        /* wait for somewhere to put it */
+        pthread_mutex_lock(&ring->lock);
+        pthread_cleanup_push(unlock_mutex,&ring->lock);
+        while (ring->count==STREAM_CHUNKS) {
+            pthread_cond_wait(&ring->cond,&ring->lock);
+        }
+        pthread_cleanup_pop(0);
+        int slot=ring->head;
+        pthread_mutex_unlock(&ring->lock);
+
+        /* wait for input first, so the read stage is the copy, not the writer's dawdling */
+        struct pollfd ready={ ring->fd, POLLIN, 0 };
+        poll(&ready,1,-1);
+        long long t0=now_ns();
+        ssize_t num_read=read(ring->fd,ring->data+(size_t)slot*STREAM_CHUNK,STREAM_CHUNK);
+        ring->read_ns[slot]=now_ns()-t0;
+        if ((num_read<0)&&(errno==EINTR)) {
+            continue;
+        }
+        /* somebody handed us a non-blocking descriptor, wait politely */
+        if ((num_read<0)&&(errno==EAGAIN)) {
+            struct pollfd pfd={ ring->fd, POLLIN, 0 };
+            poll(&pfd,1,-1);
+            continue;
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        if (num_read<=0) {
+            ring->done=1;
+            ring->err=(num_read<0)?errno:0;
+        } else {
+            ring->len[slot]=(size_t)num_read;
+            ring->head=(ring->head+1)%STREAM_CHUNKS;
+            ring->count++;
+        }
+        pthread_cond_signal(&ring->cond);
+        int done=ring->done;
+        pthread_mutex_unlock(&ring->lock);
+
+        if (done) {
+            return NULL;
+        }
+    }
+}
+
+/* the io_uring way: the next chunk's read is in flight, and goes over */
+/* with the writes, while this one's typed                             */
+static void send_stream_uring(int fd)
+{
+    int buf=0;
+    uring_read(fd,buf);
+    while (1) {
+        if (!uring.read_done) {
+            uring_submit(URING_NOWAIT);
+        }
+        if (!uring.read_done) {
+            /* about to wait, so whatever is queued may as well go out */
+            flush_events(&out);
+            pace_idle();
+            uring_submit(URING_READ_DONE);
+        }
+        if (abort_requested) {
+            break;
+        }
+        int len=uring.read_len;
+        if (len<=0) {
+            if (len<0) {
+                error(0,-len,"Error reading input");
+            }
+            break;
+        }
+        stat_reads++;
+        stat_bytes+=(size_t)len;
+        uring.reads_done++;
+
+        char* chunk=uring.reads+(size_t)buf*URING_READ_SIZE;
+        buf^=1;
+        uring_read(fd,buf);
+        send_buffer(chunk,(size_t)len);
+        if (abort_requested) {
+            break;
+        }
+    }
+}
+
+/* send anything we can't map: pipes, FIFOs, stdin, char devices.  A  */
+/* reader thread keeps the ring topped up while we type what's there. */
+static void send_stream(int fd)
+{
+    if (uring.fd>=0) {
+        send_stream_uring(fd);
+        return;
+    }
+
+    stream_ring ring;
+    memset(&ring,0,sizeof(ring));
+    ring.fd=fd;
+    ring.data=malloc((size_t)STREAM_CHUNKS*STREAM_CHUNK);
+    if (ring.data==NULL) {
+        error(EXIT_FAILURE,errno,"Unable to allocate stream buffer");
+        /* no return */
+    }
+    pthread_mutex_init(&ring.lock,NULL);
+    pthread_cond_init(&ring.cond,NULL);
+
+    pthread_t reader;
+    if (pthread_create(&reader,NULL,stream_reader,&ring)) {
+        error(EXIT_FAILURE,0,"Unable to start reader thread");
+        /* no return */
+    }
+
+    while (1) {
+        pthread_mutex_lock(&ring.lock);
+        while ((ring.count==0)&&(ring.done==0)) {
+            /* about to sleep, so whatever is queued may as well go out */
+            pthread_mutex_unlock(&ring.lock);
+            flush_events(&out);
+            pace_idle();
+            pthread_mutex_lock(&ring.lock);
+            if ((ring.count==0)&&(ring.done==0)) {
+                pthread_cond_wait(&ring.cond,&ring.lock);
+            }
+        }
+        if (ring.count==0) {
+            /* input all gone! */
+            pthread_mutex_unlock(&ring.lock);
+            break;
+        }
+        int slot=ring.tail;
+        pthread_mutex_unlock(&ring.lock);
+
+        hist_add(&stage_ns[STAGE_READ],ring.read_ns[slot]);
+        stat_reads++;
+        stat_bytes+=ring.len[slot];
+        send_buffer(ring.data+(size_t)slot*STREAM_CHUNK,ring.len[slot]);
+        if (abort_requested) {
+            /* reader may be sat in read(), don't wait for it */
+            pthread_cancel(reader);
+            break;
+        }
+
+        /* hand the chunk back */
+        pthread_mutex_lock(&ring.lock);
+        ring.tail=(ring.tail+1)%STREAM_CHUNKS;
+        ring.count--;
+        pthread_cond_signal(&ring.cond);
+        pthread_mutex_unlock(&ring.lock);
+    }
+
+    pthread_join(reader,NULL);
+    if (ring.err) {
+        error(0,ring.err,"Error reading input");
+    }
+    pthread_cond_destroy(&ring.cond);
+    pthread_mutex_destroy(&ring.lock);
+    free(ring.data);
+}
+
+/* type an already open file (closing it, unless it's stdin) */
+static void send_file(int fd)
+{
+    pace_reset();
+    unsigned long chars=stat_chars, events=out.events, writes=out.writes;
+    double start=now_seconds();
+
+    struct stat st;
+    if ((fstat(fd,&st)==0)&&(S_ISREG(st.st_mode))&&(st.st_size>0)) {
+        send_mapped(fd,st.st_size);
+    } else {
+        send_stream(fd);
+    }
+
+    if (fd) {
+        close(fd);
+    }
+    adapt_line();
+    flush_events(&out);
+
+    report_send("File",stat_chars-chars,out.events-events,out.writes-writes,now_seconds()-start);
+}
+
+/* send a file, '-' being stdin */
+static int connect_file(const char* filename)
+{
+    if (verbose_mode>0) {
+        log_printf("Sending file: %s\n",filename);
+    }
+
+    int fd=0;
+    if (strcmp(filename,"-")!=0) {
+        fd=open(filename,O_RDONLY);
+        if (fd<0) {
+            perror("Error opening file for reading");
+            return -1;
+        }
+    }
+    send_file(fd);
+    return 0;
+}
+
+/* forward everything still held down, as far as we've said, back up */
+static void grab_release(unsigned char* down)
+{
+    struct input_event event;
+    int count=0;
+
+    for (unsigned int code=0; code<KEY_CNT; code++) {
+        if (down[code/8]&(1<<(code%8))) {
+            put_event(&event, EV_KEY, (unsigned short)code, 0);
+            queue_frame(&out, &event, 1);
+            count++;
+        }
+    }
+    if (count) {
+        put_event(&event, EV_SYN, SYN_REPORT, 0);
+        queue_frame(&out, &event, 1);
+    }
+    memset(down, 0, KEY_CNT/8+1);
+}
+
+/* Raw mode: pass along what a local device (or recorded file) sends,  */
+/* a frame at a time, with nothing translated.  Autorepeats are left   */
+/* to the far end's own, and a key only goes up if it went down here.  */
+static int grab_input(const char* path)
+{
+    static unsigned char down[KEY_CNT/8+1];
+    static struct input_event frame[EVBUF_MAX/4];
+    struct input_event events[64];
+    struct stat sb;
+
+    int fd=open(path,O_RDONLY|O_CLOEXEC);
+    if ((fd<0)||(fstat(fd,&sb))) {
+        error(0,errno,"Unable to open input: '%s'",path);
+        return 1;
+    }
+    int device=S_ISCHR(sb.st_mode);
+
+    if (device) {
+        /* let go of the keys first, or they're stuck down locally */
+        long long deadline=now_ns()+(long long)GRAB_SETTLE*1000000LL;
+        unsigned char state[KEY_CNT/8+1];
+        while (now_ns()<deadline) {
+            memset(state,0,sizeof(state));
+            if (ioctl(fd,EVIOCGKEY(sizeof(state)),state)<0) {
+                break;
+            }
+            int held=0;
+            for (unsigned int i=0; i<sizeof(state); i++) {
+                held|=state[i];
+            }
+            if (!held) {
+                break;
+            }
+            usleep(10000);
+        }
+        if (ioctl(fd,EVIOCGRAB,1)) {
+            error(0,errno,"Unable to grab input: '%s'",path);
+            close(fd);
+            return 1;
+        }
+        if (verbose_mode) {
+            fprintf(stderr,"Grabbed %s, hold both Ctrl keys to let go\n",path);
+        }
+    }
+
+    unsigned long received=0, forwarded=0, frames=0;
+    int count=0;
+    int released=0;
+    memset(down,0,sizeof(down));
+
+    while ((!released)&&(!abort_requested)) {
+        ssize_t num_read=read(fd,events,sizeof(events));
+        if (num_read<0) {
+            if (errno==EINTR) {
+                continue;
+            }
+            error(0,errno,"Error reading input");
+            break;
+        }
+        if (num_read<(ssize_t)sizeof(events[0])) {
+            /* end of the recording, or the device went away */
+            break;
+        }
+
+        int num=(int)(num_read/(ssize_t)sizeof(events[0]));
+        received+=(unsigned long)num;
+        for (int i=0; i<num; i++) {
+            unsigned short type=events[i].type;
+            unsigned short code=events[i].code;
+            int value=events[i].value;
+
+            if (type==EV_SYN) {
+                if (code==SYN_DROPPED) {
+                    /* the kernel lost some, so we've no idea what's held */
+                    count=0;
+                    grab_release(down);
+                } else if ((code==SYN_REPORT)&&(count)) {
+                    put_event(&frame[count++], EV_SYN, SYN_REPORT, 0);
+                    queue_frame(&out, frame, count);
+                    forwarded+=(unsigned long)count;
+                    frames++;
+                    count=0;
+                }
+                continue;
+            }
+            if (type==EV_KEY) {
+                if ((code>=KEY_CNT)||(value>1)) {
+                    continue;
+                }
+                int was=(down[code/8]>>(code%8))&1;
+                if (value==was) {
+                    continue;
+                }
+                down[code/8]^=(unsigned char)(1<<(code%8));
+            } else if (type!=EV_REL) {
+                continue;
+            }
+            put_event(&frame[count++], type, code, value);
+            if (count==(int)(sizeof(frame)/sizeof(frame[0]))-1) {
+                /* no SYN in sight, don't hang on to it forever */
+                queue_frame(&out, frame, count);
+                forwarded+=(unsigned long)count;
+                count=0;
+            }
+
+            /* the way out, once both are down */
+            if ((type==EV_KEY)&&(value)&&(device)&&
+                (down[KEY_LEFTCTRL/8]&(1<<(KEY_LEFTCTRL%8)))&&(down[KEY_RIGHTCTRL/8]&(1<<(KEY_RIGHTCTRL%8)))) {
+                released=1;
+                break;
+            }
+        }
+        flush_events(&out);
+    }
+
+    /* whatever we'd pressed comes back up on the far end */
+    if (count) {
+        queue_frame(&out, frame, count);
+    }
+    grab_release(down);
+    flush_events(&out);
+
+    if (device) {
+        ioctl(fd,EVIOCGRAB,0);
+    }
+    close(fd);
+
+    if (verbose_mode) {
+        fprintf(stderr,"Input: %lu events read, %lu forwarded in %lu frames%s\n",
+                received,forwarded,frames,released?", released":"");
+    }
+    return 0;
+}
+
+/* Play a recording back, nothing translated.  Each frame is due at   */
+/* its recorded time (divided by the speed) from the start, and goes  */
+/* in a write of its own once it is, so lateness can't pile up; flat  */
+/* out, it's batched like anything else.                               */
+static int replay_events(const char* path)
+{
+    static struct input_event frame[EVBUF_MAX/4];
+    struct stat sb;
+
+    int fd=open(path, O_RDONLY|O_CLOEXEC);
+    if ((fd<0)||(fstat(fd, &sb))) {
+        error(0, errno, "Unable to open recording: '%s'", path);
+        return 1;
+    }
+    if (sb.st_size<RECORD_HEADER_SIZE) {
+        error(0, 0, "Not a recording: '%s'", path);
+        close(fd);
+        return 1;
+    }
+    size_t size=(size_t)sb.st_size;
+    const unsigned char* base=mmap(NULL, size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+    close(fd);
+    if (base==MAP_FAILED) {
+        error(0, errno, "Unable to map recording: '%s'", path);
+        return 1;
+    }
+    if ((memcmp(base, RECORD_MAGIC, 4)!=0)||(base[4]!=RECORD_VERSION)) {
+        error(0, 0, "Not a recording (or the wrong version): '%s'", path);
+        munmap((void*)base, size);
+        return 1;
+    }
+
+    /* no count if the recorder never finished, take what's there */
+    uint32_t count;
+    memcpy(&count, base+8, sizeof(count));
+    size_t total=(size-RECORD_HEADER_SIZE)/sizeof(record_event);
+    if ((count==0)||(count>total)) {
+        count=(uint32_t)total;
+    }
+    const record_event* events=(const record_event*)(base+RECORD_HEADER_SIZE);
+
+    unsigned long frames=0, late_count=0;
+    long long late_total=0, late_max=0, recorded=0;
+    long long start=now_ns();
+    int num=0;
+
+    for (uint32_t i=0; (i<count)&&(!abort_requested); i++) {
+        put_event(&frame[num++], events[i].type, events[i].code, events[i].value);
+        if ((events[i].type!=EV_SYN)||(events[i].code!=SYN_REPORT)) {
+            if (num==(int)(sizeof(frame)/sizeof(frame[0]))) {
+                queue_frame(&out, frame, num);
+                num=0;
+            }
+            continue;
+        }
+        frame[num-1].value=0;
+        recorded+=(events[i].value>0)?(long long)events[i].value*1000LL:0;
+
+        if (replay_speed>0) {
+            long long due=start+(long long)((double)recorded/replay_speed);
+            if (now_ns()<due) {
+                flush_events(&out);
+                sleep_until(due);
+            }
+            queue_frame(&out, frame, num);
+            flush_events(&out);
+
+            /* how far behind the recording did it go? */
+            long long late=now_ns()-due;
+            late_total+=late;
+            if (late>late_max) {
+                late_max=late;
+            }
+            if (late>1000000LL) {
+                late_count++;
+            }
+        } else {
+            queue_frame(&out, frame, num);
+        }
+        frames++;
+        num=0;
+    }
+    if (num) {
+        queue_frame(&out, frame, num);
+    }
+    flush_events(&out);
+    double elapsed=(double)(now_ns()-start)/1e9;
+    munmap((void*)base, size);
+
+    if (verbose_mode) {
+        fprintf(stderr, "Replay: %u events, %lu frames in %.3fs (recorded %.3fs, speed %s)\n",
+                count, frames, elapsed, (double)recorded/1e9, (replay_speed>0)?"timed":"max");
+        if ((replay_speed>0)&&(frames)) {
+            fprintf(stderr, "Timing: mean %.3fms behind, worst %.3fms, %lu frames more than 1ms late\n",
+                    (double)late_total/(double)frames/1e6, (double)late_max/1e6, late_count);
+        }
+    }
+    return 0;
+}
+
+/* Scripts, -x.  One statement a line, '#' for comments:             */
+/*     key ctrl+alt+f2 ...   chords (layout syntax), pressed and let go */
+/*     press shift           hold a key down (or a chord's modifiers)   */
+/*     release shift         and let it go                              */
+/*     type some text        the rest of the line, through the layout   */
+/*     line some text        the same, then Enter                       */
+/*     text motd.txt         a text file, typed                         */
+/*     wait 500              pause, in ms                               */
+/*     repeat 20 ... end     go round again, nested up to SCRIPT_NEST   */
+/*     include other.fxs     another script's statements                */
+/* Compiled once into ops over a pool of ready-made events, so running */
+/* one is just copying events and counting.                            */
+enum { OP_EVENTS, OP_WAIT, OP_REPEAT, OP_NEXT };
+static const char* script_opnames[]={ "events", "wait", "repeat", "next" };
+
+#define SCRIPT_NEST 8
+#define SCRIPT_HOLDS 32
+
+/* events a single op may queue, so it fits the output buffer */
+#define SCRIPT_CHUNK (EVBUF_MAX/2)
+
+typedef struct {
+    uint16_t op;
+    /* OP_REPEAT/OP_NEXT: which loop counter */
+    uint16_t slot;
+    /* OP_EVENTS: first event; OP_WAIT: ms; OP_REPEAT: times round; */
+    /* OP_NEXT: the OP_REPEAT it goes back to                       */
+    uint32_t arg;
+    /* OP_EVENTS: how many, and characters typed by them; OP_REPEAT: */
+    /* its OP_NEXT, where 'repeat 0' goes                            */
+    uint32_t count;
+    uint32_t chars;
+    /* source line, for --dump */
+    uint32_t line;
+} script_op;
+
+typedef struct {
+    const char* name;
+    script_op* ops;
+    size_t op_count;
+    size_t op_alloc;
+    struct input_event* events;
+    size_t event_count;
+    size_t event_alloc;
+    /* keys held by 'press', let go of at the end whatever happens */
+    unsigned short holds[SCRIPT_HOLDS];
+    int hold_count;
+    /* open 'repeat's while compiling, by their ops */
+    size_t nest[SCRIPT_NEST];
+    int depth;
+    int loops;
+} script;
+
+/* compiled scripts are shown rather than run, --dump */
+static int script_dump=0;
+
+/* a new op at the end of the script */
+static script_op* script_add(script* scr, uint16_t op, uint32_t line)
+{
+    if (scr->op_count==scr->op_alloc) {
+        scr->op_alloc=scr->op_alloc?scr->op_alloc*2:64;
+        scr->ops=realloc(scr->ops,scr->op_alloc*sizeof(scr->ops[0]));
+        if (scr->ops==NULL) {
+            error(EXIT_FAILURE,errno,"Out of memory");
+            /* no return */
+        }
+    }
+    script_op* sop=&scr->ops[scr->op_count++];
+    memset(sop,0,sizeof(*sop));
+    sop->op=op;
+    sop->line=line;
+    return sop;
+}
+
+/* Events to be sent, whole frames only.  They join the last op if it */
+/* sends events too and there's room, else start one of their own.   */
+static void script_events(script* scr, const struct input_event* events, int count, int chars, uint32_t line)
+{
+    if (scr->event_count+(size_t)count>scr->event_alloc) {
+        scr->event_alloc=(scr->event_alloc?scr->event_alloc*2:1024)+(size_t)count;
+        scr->events=realloc(scr->events,scr->event_alloc*sizeof(scr->events[0]));
+        if (scr->events==NULL) {
+            error(EXIT_FAILURE,errno,"Out of memory");
+            /* no return */
+        }
+    }
+
+    script_op* sop=scr->op_count?&scr->ops[scr->op_count-1]:NULL;
+    if ((sop==NULL)||(sop->op!=OP_EVENTS)||(sop->count+(uint32_t)count>SCRIPT_CHUNK)) {
+        sop=script_add(scr,OP_EVENTS,line);
+        sop->arg=(uint32_t)scr->event_count;
+    }
+    memcpy(scr->events+scr->event_count,events,(size_t)count*sizeof(events[0]));
+    scr->event_count+=(size_t)count;
+
+    /* scripts can press keys no layout types, Enter and the keypad too */
+    for (int i=0; i<count; i++) {
+        if (events[i].type==EV_KEY) {
+            use_key(events[i].code);
+        }
+    }
+    sop->count+=(uint32_t)count;
+    sop->chars+=(uint32_t)chars;
+}
+
+/* text typed through the layout, a character at a time */
+static void script_text(script* scr, const char* text, size_t len, const char* origin, uint32_t line)
+{
+    struct input_event events[TEMPLATE_MAX];
+    size_t i=0;
+
+    while (i<len) {
+        uint32_t codepoint;
+        int used=utf8_decode(text+i,&codepoint);
+        if (used<0) {
+            error(EXIT_FAILURE,0,"%s:%u: not UTF-8",origin,line);
+            /* no return */
+        }
+        i+=(size_t)used;
+
+        uint32_t entry=layout_entry(layout,codepoint);
+        if (entry==0) {
+            error(0,0,"%s:%u: no keys for U+%04X in layout '%s', skipped",origin,line,codepoint,layout->name);
+            continue;
+        }
+        int count=expand_strokes(layout_strokes(layout,entry),(int)(entry>>24),events);
+        script_events(scr,events,count,1,line);
+    }
+}
+
+/* a file's whole contents, or NULL */
+static char* script_read(const char* path, size_t* len)
+{
+    FILE* fp=fopen(path,"r");
+    char* text=NULL;
+    long size=-1;
+    if ((fp)&&(fseek(fp,0,SEEK_END)==0)&&((size=ftell(fp))>=0)) {
+        rewind(fp);
+        text=malloc((size_t)size+1);
+    }
+    if ((text)&&(fread(text,1,(size_t)size,fp)!=(size_t)size)) {
+        free(text);
+        text=NULL;
+    }
+    if (fp) {
+        fclose(fp);
+    }
+    if (text) {
+        text[size]=0;
+        *len=(size_t)size;
+    }
+    return text;
+}
+
+/* files named in a script are found next to it, unless given in full */
+static const char* script_path(const char* script, const char* name, char* buf, size_t size)
+{
+    const char* slash=strrchr(script,'/');
+    if ((name[0]=='/')||(slash==NULL)) {
+        return name;
+    }
+    snprintf(buf,size,"%.*s/%s",(int)(slash-script),script,name);
+    return buf;
+}
+
+/* a key going down or up, and the SYN which sends it */
+static void script_key(script* scr, unsigned short code, int value, uint32_t line)
+{
+    struct input_event events[2];
+    put_event(&events[0], EV_KEY, code, value);
+    put_event(&events[1], EV_SYN, SYN_REPORT, 0);
+    script_events(scr,events,2,0,line);
+}
+
+static void script_compile(script* scr, const char* path, int depth)
+{
+    size_t len;
+    char* text=script_read(path,&len);
+    if (text==NULL) {
+        error(EXIT_FAILURE,errno,"Unable to read script: '%s'",path);
+        /* no return */
+    }
+
+    uint32_t lineno=0;
+    char* next=text;
+    while (*next) {
+        char* line=next;
+        char* eol=strchr(line,'\n');
+        if (eol) {
+            *eol=0;
+            next=eol+1;
+        } else {
+            next=line+strlen(line);
+        }
+        lineno++;
+        size_t linelen=strlen(line);
+        if ((linelen)&&(line[linelen-1]=='\r')) {
+            line[--linelen]=0;
+        }
+
+        /* statement, then what it works on: words, or the rest of the line */
+        char* word=line+strspn(line," \t");
+        if ((*word==0)||(*word=='#')) {
+            continue;
+        }
+        char* rest=word+strcspn(word," \t");
+        if (*rest) {
+            *rest++=0;
+        }
+        if ((strcmp(word,"type")==0)||(strcmp(word,"line")==0)) {
+            script_text(scr,rest,strlen(rest),path,lineno);
+            if (word[0]=='l') {
+                struct input_event events[STROKE_EVENTS_MAX];
+                uint16_t enter=KEY_ENTER;
+                script_events(scr,events,expand_strokes(&enter,1,events),1,lineno);
+            }
+            continue;
+        }
+
+        char* save=NULL;
+        char* arg=strtok_r(rest," \t",&save);
+        if ((arg==NULL)&&(strcmp(word,"end")!=0)) {
+            error(EXIT_FAILURE,0,"%s:%u: '%s' needs something to work on",path,lineno,word);
+            /* no return */
+        }
+
+        if (strcmp(word,"key")==0) {
+            /* one or more chords */
+            for (; arg; arg=strtok_r(NULL," \t",&save)) {
+                struct input_event events[STROKE_EVENTS_MAX];
+                uint16_t stroke=parse_stroke(arg);
+                if (stroke==0) {
+                    error(EXIT_FAILURE,0,"%s:%u: unknown key '%s'",path,lineno,arg);
+                    /* no return */
+                }
+                script_events(scr,events,expand_strokes(&stroke,1,events),0,lineno);
+            }
+        } else if ((strcmp(word,"press")==0)||(strcmp(word,"release")==0)) {
+            int value=(word[0]=='p');
+            for (; arg; arg=strtok_r(NULL," \t",&save)) {
+                /* a modifier on its own, or a chord: modifiers first down, last up */
+                unsigned short codes[5];
+                int count=0;
+                unsigned int m;
+                for (m=0; m<sizeof(stroke_mods)/sizeof(stroke_mods[0]); m++) {
+                    if (strcmp(arg,stroke_mods[m].name)==0) {
+                        codes[count++]=stroke_mods[m].code;
+                        break;
+                    }
+                }
+                if (count==0) {
+                    uint16_t stroke=parse_stroke(arg);
+                    if (stroke==0) {
+                        error(EXIT_FAILURE,0,"%s:%u: unknown key '%s'",path,lineno,arg);
+                        /* no return */
+                    }
+                    for (m=0; m<sizeof(stroke_mods)/sizeof(stroke_mods[0]); m++) {
+                        if (stroke&stroke_mods[m].flag) {
+                            codes[count++]=stroke_mods[m].code;
+                        }
+                    }
+                    codes[count++]=stroke&STROKE_KEY;
+                }
+                for (int i=0; i<count; i++) {
+                    unsigned short code=codes[value?i:count-1-i];
+                    script_key(scr,code,value,lineno);
+                    if (value) {
+                        int known=0;
+                        for (int h=0; h<scr->hold_count; h++) {
+                            known|=(scr->holds[h]==code);
+                        }
+                        /* every one has to be let go of at the end */
+                        if ((!known)&&(scr->hold_count==SCRIPT_HOLDS)) {
+                            error(EXIT_FAILURE,0,"%s:%u: more than %d different keys pressed",path,lineno,SCRIPT_HOLDS);
+                            /* no return */
+                        }
+                        if (!known) {
+                            scr->holds[scr->hold_count++]=code;
+                        }
+                    }
+                }
+            }
+        } else if (strcmp(word,"wait")==0) {
+            char* endptr=NULL;
+            errno=0;
+            long ms=strtol(arg,&endptr,0);
+            if ((errno)||(*endptr)||(ms<0)||(ms>INT32_MAX)) {
+                error(EXIT_FAILURE,0,"%s:%u: bad wait '%s'",path,lineno,arg);
+                /* no return */
+            }
+            script_add(scr,OP_WAIT,lineno)->arg=(uint32_t)ms;
+        } else if (strcmp(word,"repeat")==0) {
+            char* endptr=NULL;
+            errno=0;
+            long times=strtol(arg,&endptr,0);
+            if ((errno)||(*endptr)||(times<0)||(times>INT32_MAX)) {
+                error(EXIT_FAILURE,0,"%s:%u: bad repeat '%s'",path,lineno,arg);
+                /* no return */
+            }
+            if (scr->depth==SCRIPT_NEST) {
+                error(EXIT_FAILURE,0,"%s:%u: repeats nested too deep",path,lineno);
+                /* no return */
+            }
+            script_op* sop=script_add(scr,OP_REPEAT,lineno);
+            sop->arg=(uint32_t)times;
+            sop->slot=(uint16_t)scr->depth;
+            scr->nest[scr->depth++]=scr->op_count-1;
+            if (scr->depth>scr->loops) {
+                scr->loops=scr->depth;
+            }
+        } else if (strcmp(word,"end")==0) {
+            if (scr->depth==0) {
+                error(EXIT_FAILURE,0,"%s:%u: 'end' without 'repeat'",path,lineno);
+                /* no return */
+            }
+            size_t start=scr->nest[--scr->depth];
+            script_op* sop=script_add(scr,OP_NEXT,lineno);
+            sop->arg=(uint32_t)start;
+            sop->slot=(uint16_t)scr->depth;
+            scr->ops[start].count=(uint32_t)(scr->op_count-1);
+        } else if (strcmp(word,"text")==0) {
+            char where[PATH_MAX];
+            size_t textlen;
+            arg=(char*)script_path(path,arg,where,sizeof(where));
+            char* body=script_read(arg,&textlen);
+            if (body==NULL) {
+                error(EXIT_FAILURE,errno,"%s:%u: unable to read '%s'",path,lineno,arg);
+                /* no return */
+            }
+            script_text(scr,body,textlen,arg,lineno);
+            free(body);
+        } else if (strcmp(word,"include")==0) {
+            if (depth==LAYOUT_INCLUDE_MAX) {
+                error(EXIT_FAILURE,0,"%s:%u: includes nested too deep",path,lineno);
+                /* no return */
+            }
+            char where[PATH_MAX];
+            script_compile(scr,script_path(path,arg,where,sizeof(where)),depth+1);
+        } else {
+            error(EXIT_FAILURE,0,"%s:%u: unknown statement '%s'",path,lineno,word);
+            /* no return */
+        }
+    }
+    free(text);
+
+    if ((depth==0)&&(scr->depth)) {
+        error(EXIT_FAILURE,0,"%s: 'repeat' without 'end'",path);
+        /* no return */
+    }
+}
+
+/* a key's name, as scripts and layouts spell it */
+static const char* key_name(unsigned short code)
+{
+    for (unsigned int m=0; m<sizeof(stroke_mods)/sizeof(stroke_mods[0]); m++) {
+        if (stroke_mods[m].code==code) {
+            return stroke_mods[m].name;
+        }
+    }
+    for (unsigned int k=0; k<sizeof(keynames)/sizeof(keynames[0]); k++) {
+        if (keynames[k].code==code) {
+            return keynames[k].name;
+        }
+    }
+    return NULL;
+}
+
+/* show what a script compiled to, --dump */
+static void script_show(const script* scr)
+{
+    printf("%s: %u ops, %u events, %d loop counters, %d held keys\n",scr->name,
+           (unsigned int)scr->op_count,(unsigned int)scr->event_count,scr->loops,scr->hold_count);
+    for (size_t pc=0; pc<scr->op_count; pc++) {
+        const script_op* sop=&scr->ops[pc];
+        printf("%04u  line %-4u %-7s",(unsigned int)pc,sop->line,script_opnames[sop->op]);
+        switch (sop->op) {
+            case OP_EVENTS:
+                printf("%4u (%u chars) ",sop->count,sop->chars);
+                for (uint32_t i=0; i<sop->count; i++) {
+                    const struct input_event* ev=&scr->events[sop->arg+i];
+                    if (ev->type==EV_SYN) {
+                        printf(" .");
+                        continue;
+                    }
+                    const char* name=key_name(ev->code);
+                    if (name) {
+                        printf(" %c%s",ev->value?'+':'-',name);
+                    } else {
+                        printf(" %c%u",ev->value?'+':'-',ev->code);
+                    }
+                }
+                break;
+            case OP_WAIT:
+                printf("%4ums",sop->arg);
+                break;
+            case OP_REPEAT:
+                printf("%4u times, counter %u, else to %04u",sop->arg,sop->slot,sop->count+1);
+                break;
+            case OP_NEXT:
+                printf("  counter %u, back to %04u",sop->slot,sop->arg+1);
+                break;
+        }
+        putchar('\n');
+    }
+}
+
+/* run a compiled script: events are copied out, waits are waited, and */
+/* loops counted, with anything 'press'ed let go of at the end         */
+static void script_run(const script* scr)
+{
+    uint32_t counters[SCRIPT_NEST];
+    unsigned long chars=stat_chars, events=out.events, writes=out.writes;
+    double start=now_seconds();
+
+    for (size_t pc=0; (pc<scr->op_count)&&(!abort_requested); pc++) {
+        const script_op* sop=&scr->ops[pc];
+        switch (sop->op) {
+            case OP_EVENTS:
+                queue_frame(&out, scr->events+sop->arg, (int)sop->count);
+                stat_chars+=sop->chars;
+                break;
+            case OP_WAIT:
+                flush_events(&out);
+                sleep_until(now_ns()+(long long)sop->arg*1000000LL);
+                break;
+            case OP_REPEAT:
+                counters[sop->slot]=sop->arg;
+                if (sop->arg==0) {
+                    pc=sop->count;
+                }
+                break;
+            case OP_NEXT:
+                if (--counters[sop->slot]) {
+                    pc=sop->arg;
+                }
+                break;
+        }
+    }
+
+    for (int i=0; i<scr->hold_count; i++) {
+        struct input_event up[2];
+        put_event(&up[0], EV_KEY, scr->holds[i], 0);
+        put_event(&up[1], EV_SYN, SYN_REPORT, 0);
+        queue_frame(&out, up, 2);
+    }
+    flush_events(&out);
+
+    report_send("Script",stat_chars-chars,out.events-events,out.writes-writes,now_seconds()-start);
+}
+
+/* compile a script, then run it or show it */
+static void connect_script(const char* path)
+{
+    script scr;
+    memset(&scr,0,sizeof(scr));
+    scr.name=path;
+
+    script_compile(&scr,path,0);
+    if (script_dump) {
+        script_show(&scr);
+    } else {
+        script_run(&scr);
+    }
+    free(scr.ops);
+    free(scr.events);
+}
+
+/* compile a script only for the keys it presses, so the device has */
+/* them all before it's created                                     */
+static void script_keys(const char* path)
+{
+    script scr;
+    memset(&scr,0,sizeof(scr));
+    scr.name=path;
+
+    script_compile(&scr,path,0);
+    free(scr.ops);
+    free(scr.events);
+}
+
+/* tell a job client how its job went */
+static int send_ack(int fd, int status, unsigned long chars)
+{
+    unsigned char ack[WIRE_HEADER_SIZE+8]={ MSG_ACK, 0, 0, 0, 0, 0, 0, 8 };
+    uint32_t value=htonl((uint32_t)status);
+    memcpy(ack+WIRE_HEADER_SIZE, &value, 4);
+    value=htonl((uint32_t)chars);
+    memcpy(ack+WIRE_HEADER_SIZE+4, &value, 4);
+    return write_full(fd, ack, sizeof(ack));
+}
+
+/* open a job's file as the client who sent it, so fauxcond won't type */
+/* out anything they couldn't have read themselves.  Only their primary */
+/* group counts, and if we can't become them, only our own files do.    */
+static int job_open(const char* path, const struct ucred* peer)
+{
+    if (path[0]!='/') {
+        errno=EINVAL;
+        return -1;
+    }
+    int old_gid=setfsgid(peer->gid);
+    int old_uid=setfsuid(peer->uid);
+    int fd=-1;
+    if ((setfsuid((uid_t)-1)==(int)peer->uid)&&(setfsgid((gid_t)-1)==(int)peer->gid)) {
+        fd=open(path, O_RDONLY|O_NOCTTY|O_CLOEXEC);
+    } else {
+        errno=EACCES;
+    }
+    int saved=errno;
+    setfsuid((uid_t)old_uid);
+    setfsgid((gid_t)old_gid);
+    errno=saved;
+    return fd;
+}
+
+/* type a string or file job from a client, as -s or -f would */
+static int run_job(int type, char* payload, uint32_t len, const struct ucred* peer, unsigned long* chars)
+{
+    unsigned long before=stat_chars;
+    int status=0;
+
+    /* it's been a while since the last job, probably */
+    pace_idle();
+
+    payload[len]=0;
+    if (type==MSG_STRING) {
+        connect_string(payload);
+    } else {
+        int fd=job_open(payload, peer);
+        if (fd<0) {
+            status=errno?errno:EIO;
+            error(0, status, "Not typing '%s' for uid %u", payload, (unsigned int)peer->uid);
+        } else {
+            if (verbose_mode>0) {
+                log_printf("Sending file: %s\n", payload);
+            }
+            send_file(fd);
+        }
+    }
+    flush_events(&out);
+    *chars=stat_chars-before;
+    return status;
+}
+
+/* take events (and jobs, for fauxcond) from one remote fauxcon until */
+/* it says goodbye                                                     */
+static void serve_connection(int in_fd, int out_fd, int take_jobs)
+{
+    static char payload[JOB_MAX_PAYLOAD+1];
+    static struct input_event events[EVBUF_MAX];
+    unsigned long received=0;
+    unsigned long jobs=0;
+
+    /* nobody gets to hold the line open by saying nothing, except */
+    /* a remote keyboard between keystrokes (jobs can't queue up   */
+    /* behind one of those on a plain -L anyway)                   */
+    struct timeval timeout={ WIRE_TIMEOUT_MS/1000, (WIRE_TIMEOUT_MS%1000)*1000 };
+    setsockopt(in_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (wire_hello(in_fd, out_fd)) {
+        error(0, errno, "Bad hello from remote");
+        return;
+    }
+
+    while (!abort_requested) {
+        unsigned char header[WIRE_HEADER_SIZE];
+        ssize_t got=read(in_fd, header, sizeof(header));
+        if ((got<0)&&((errno==EAGAIN)||(errno==EWOULDBLOCK))&&((received)||(!take_jobs))&&(!abort_requested)) {
+            continue;
+        }
+        if ((got<0)&&(errno==EINTR)&&(!abort_requested)) {
+            continue;
+        }
+        if ((got<0)&&((errno==EAGAIN)||(errno==EWOULDBLOCK))) {
+            error(0, 0, "Remote idle too long, dropping it");
+            break;
+        }
+        if ((got<=0)||
+            (((size_t)got<sizeof(header))&&(read_full(in_fd, header+got, sizeof(header)-(size_t)got)!=1))) {
+            break;
+        }
+        uint32_t len;
+        memcpy(&len, header+4, 4);
+        len=ntohl(len);
+        int is_job=((header[0]==MSG_STRING)||(header[0]==MSG_FILE));
+        if ((len>(is_job?JOB_MAX_PAYLOAD:WIRE_MAX_PAYLOAD))||((!is_job)&&(len%WIRE_EVENT_SIZE))) {
+            error(0, 0, "Bad message from remote (type %d, %u bytes)", header[0], (unsigned int)len);
+            break;
+        }
+        if ((len)&&(read_full(in_fd, payload, len)!=1)) {
+            break;
+        }
+
+        if (header[0]==MSG_BYE) {
+            break;
+        }
+        if ((is_job)&&(!take_jobs)) {
+            error(0, 0, "Refusing job from remote, only fauxcond (-D) takes jobs");
+            if (send_ack(out_fd, EPERM, 0)) {
+                break;
+            }
+            continue;
+        }
+        if (is_job) {
+            /* jobs run to completion, in the order they arrive */
+            struct ucred peer;
+            socklen_t peer_len=sizeof(peer);
+            if (getsockopt(in_fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len)) {
+                error(0, errno, "Unable to tell who sent a job");
+                break;
+            }
+            unsigned long chars=0;
+            int status=run_job(header[0], payload, len, &peer, &chars);
+            jobs++;
+            if (send_ack(out_fd, status, chars)) {
+                break;
+            }
+            continue;
+        }
+        if (header[0]!=MSG_EVENTS) {
+            /* newer than us? skip it */
+            continue;
+        }
+
+        /* unpack, only passing on the sort of events we handle */
+        int count=0;
+        for (uint32_t i=0; i<len/WIRE_EVENT_SIZE; i++) {
+            const char* ptr=payload+i*WIRE_EVENT_SIZE;
+            uint16_t type, code;
+            uint32_t value;
+            memcpy(&type, ptr, 2);
+            memcpy(&code, ptr+2, 2);
+            memcpy(&value, ptr+4, 4);
+            type=ntohs(type);
+            if ((type!=EV_SYN)&&(type!=EV_KEY)&&(type!=EV_REL)) {
+                continue;
+            }
+            memset(&events[count], 0, sizeof(events[count]));
+            events[count].type=type;
+            events[count].code=ntohs(code);
+            events[count].value=(int)ntohl(value);
+            count++;
+        }
+        if (count) {
+            queue_frame(&out, events, count);
+        }
+        received+=(unsigned long)count;
+
+        /* one message in, one write out, no waiting around */
+        flush_events(&out);
+    }
+
+    /* whatever happened over there, nothing stays held down here */
+    flush_events(&out);
+    release_keys(&out);
+
+    if (verbose_mode) {
+        fprintf(stderr, "Remote session ended, %lu events and %lu jobs received\n", received, jobs);
+    }
+}
+
+/* be the far end of remote mode: tcp:[host:]port, unix:path or '-' for */
+/* stdin/stdout (as started by 'ssh:host' on the near end).  Jobs are  */
+/* only taken when we're fauxcond, on its unix socket.                 */
+static void serve_remote(const char* spec, int take_jobs)
+{
+    if (strcmp(spec, "-")==0) {
+        serve_connection(0, 1, 0);
+        return;
+    }
+
+    int listener=-1;
+    if (strncmp(spec, "tcp:", 4)==0) {
+        struct addrinfo* addrs=resolve(spec+4);
+        for (struct addrinfo* ai=addrs; ai; ai=ai->ai_next) {
+            listener=socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC, ai->ai_protocol);
+            if (listener<0) {
+                continue;
+            }
+            int one=1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if ((bind(listener, ai->ai_addr, ai->ai_addrlen)==0)&&(listen(listener, 64)==0)) {
+                /* there's no authentication: whoever can reach it can type here */
+                int loopback=(ai->ai_family==AF_INET)?
+                    ((ntohl(((struct sockaddr_in*)ai->ai_addr)->sin_addr.s_addr)>>24)==127):
+                    IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6*)ai->ai_addr)->sin6_addr);
+                if (!loopback) {
+                    fprintf(stderr, "Warning: '%s' lets anyone who can reach it type on this console,"
+                            " use ssh: to cross a network\n", spec);
+                }
+                break;
+            }
+            close(listener);
+            listener=-1;
+        }
+        freeaddrinfo(addrs);
+    } else if (strncmp(spec, "unix:", 5)==0) {
+        struct sockaddr_un addr;
+        unix_address(&addr, spec+5);
+        unlink(addr.sun_path);
+        listener=socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        /* owner and group only, whatever the umask says */
+        mode_t mask=umask(0117);
+        if ((listener>=0)&&((bind(listener, (struct sockaddr*)&addr, sizeof(addr)))||(listen(listener, 64)))) {
+            close(listener);
+            listener=-1;
+        }
+        umask(mask);
+    } else {
+        error(EXIT_FAILURE, 0, "Unknown listen address (-L|--listen): '%s'", spec);
+        /* no return */
+    }
+    if (listener<0) {
+        error(EXIT_FAILURE, errno, "Unable to listen on '%s'", spec);
+        /* no return */
+    }
+
+    if (verbose_mode) {
+        fprintf(stderr, "Listening on %s\n", spec);
+    }
+
+    /* one remote at a time, they'd only fight over the keyboard anyway. */
+    /* Everyone else waits in the listen backlog, so jobs run in order.  */
+    while (!abort_requested) {
+        int fd=accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd<0) {
+            if (errno==EINTR) {
+                continue;
+            }
+            error(0, errno, "Error accepting remote");
+            break;
+        }
+        int one=1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        serve_connection(fd, fd, take_jobs);
+        close(fd);
+    }
+
+    close(listener);
+    if (strncmp(spec, "unix:", 5)==0) {
+        unlink(spec+5);
+    }
+}
+
+/* hand -s/-S/-f to a fauxcond as jobs, rather than typing them here. */
+/* Returns 0 once it has typed the lot.                                */
+static int send_job(int fd, int type, const char* payload, size_t len)
+{
+    unsigned char header[WIRE_HEADER_SIZE]={ (unsigned char)type, 0, 0, 0, 0, 0, 0, 0 };
+    uint32_t nlen=htonl((uint32_t)len);
+    memcpy(header+4, &nlen, 4);
+
+    double start=now_seconds();
+    if ((write_full(fd, header, sizeof(header)))||(write_full(fd, payload, len))) {
+        error(EXIT_FAILURE, errno, "Unable to send job");
+        /* no return */
+    }
+
+    /* wait to hear how it went */
+    unsigned char ack[WIRE_HEADER_SIZE+8];
+    if ((read_full(fd, ack, sizeof(ack))!=1)||(ack[0]!=MSG_ACK)) {
+        error(EXIT_FAILURE, errno, "No answer from fauxcond");
+        /* no return */
+    }
+    uint32_t status, chars;
+    memcpy(&status, ack+WIRE_HEADER_SIZE, 4);
+    memcpy(&chars, ack+WIRE_HEADER_SIZE+4, 4);
+    status=ntohl(status);
+    chars=ntohl(chars);
+
+    if (verbose_mode) {
+        fprintf(stderr, "Job: %u chars typed in %.3fs\n", (unsigned int)chars, now_seconds()-start);
+    }
+    if (status) {
+        error(0, (int)status, "fauxcond couldn't send '%.*s'", (int)len, payload);
+        return -1;
+    }
+    return 0;
+}
+
+/* send stdin to fauxcond as a series of string jobs */
+static int send_stdin_job(int fd)
+{
+    static char buffer[JOB_MAX_PAYLOAD];
+    while (1) {
+        ssize_t num_read=read(0, buffer, sizeof(buffer));
+        if ((num_read<0)&&(errno==EINTR)) {
+            continue;
+        }
+        if (num_read<0) {
+            error(0, errno, "Error reading stdin");
+            return -1;
+        }
+        if (num_read==0) {
+            return 0;
+        }
+        if (send_job(fd, MSG_STRING, buffer, (size_t)num_read)) {
+            return -1;
+        }
+    }
+}
+
+/* size of each synthetic benchmark corpus, in bytes */
+#define BENCH_CORPUS_SIZE (4*1024*1024)
+
+/* where the corpora start from */
+#define BENCH_SEED 0x5eed
+
+/* keystrokes timed one by one for the latency percentiles */
+#define BENCH_LATENCY_SAMPLES 200000
+
+/* keys per frame for the optimizer's throughput run */
+#define BENCH_OPTIMIZE 8
+
+/* tiny repeatable random number generator, same corpus every run */
+static unsigned int bench_random(unsigned int* seed)
+{
+    *seed=*seed*1103515245u+12345u;
+    return (*seed>>16)&0x7fff;
+}
+
+/* fill buffer with one of the synthetic corpora, by name, each seed */
+/* giving a different (but repeatable) one                            */
+static void bench_corpus(const char* name, char* buffer, size_t size, unsigned int seed)
+{
+    static const char* shifted="ABCDEFGHIJKLMNOPQRSTUVWXYZ!@#$%^&*()_+{}|:\"<>?~";
+    static const char* script[]={
+        "#!/bin/sh\n",
+        "set -e\n",
+        "export PATH=/usr/local/bin:$PATH\n",
+        "for i in $(seq 1 10); do\n    echo \"line $i\" >> /tmp/out.txt\ndone\n",
+        "if [ -f /etc/hostname ]; then cat /etc/hostname; fi\n",
+        "apt-get install -y build-essential git curl\n",
+        "sed -i 's/^#\\(PermitRootLogin\\).*/\\1 no/' /etc/ssh/sshd_config\n",
+        "systemctl enable --now ssh && echo \"ok\" || echo \"FAILED: $?\"\n",
+    };
+    size_t pos=0;
+
+    while (pos<size) {
+        if (strcmp(name,"lowercase")==0) {
+            /* words, spaces and the odd line break */
+            int r=(int)(bench_random(&seed)%32);
+            buffer[pos++]=(r<26)?(char)('a'+r):((r<31)?' ':'\n');
+        } else if (strcmp(name,"shifted")==0) {
+            buffer[pos++]=shifted[bench_random(&seed)%strlen(shifted)];
+        } else if (strcmp(name,"control")==0) {
+            /* everything from ^@ to ^Z, including CR & LF */
+            buffer[pos++]=(char)(bench_random(&seed)%27);
+        } else {
+            const char* line=script[bench_random(&seed)%(sizeof(script)/sizeof(script[0]))];
+            size_t len=strlen(line);
+            if (len>size-pos) {
+                len=size-pos;
+            }
+            memcpy(buffer+pos,line,len);
+            pos+=len;
+        }
+    }
+}
+
+/* qsort helper for latency samples */
+static int bench_compare(const void* a, const void* b)
+{
+    unsigned long x=*(const unsigned long*)a;
+    unsigned long y=*(const unsigned long*)b;
+    return (x>y)-(x<y);
+}
+
+/* push every corpus through connect_file() and sendchar(), reporting */
+/* throughput and per-keystroke latency as JSON into jsonname         */
+static void run_bench(const char* jsonname)
+{
+    static const char* corpora[]={ "lowercase", "shifted", "control", "script" };
+    static const char* ts_names[]={ "kernel", "frame" };
+    static const char* paths[]={ "byte", "bulk", "opt" };
+
+    FILE* json=stdout;
+    if (strcmp(jsonname,"-")!=0) {
+        json=fopen(jsonname,"w");
+        if (json==NULL) {
+            error(EXIT_FAILURE,errno,"Unable to write benchmark results: '%s'",jsonname);
+            /* no return */
+        }
+    }
+
+    char* buffer=malloc(BENCH_CORPUS_SIZE);
+    unsigned long* samples=malloc(BENCH_LATENCY_SAMPLES*sizeof(samples[0]));
+    int memfd=memfd_create("fauxcon-bench",0);
+    if ((buffer==NULL)||(samples==NULL)||(memfd<0)) {
+        error(EXIT_FAILURE,errno,"Unable to set up benchmark");
+        /* no return */
+    }
+    char memfd_name[64];
+    snprintf(memfd_name,sizeof(memfd_name),"/proc/self/fd/%d",memfd);
+
+    /* keep the report output out of the numbers */
+    int saved_verbose=verbose_mode;
+    verbose_mode=0;
+    int saved_batch=batch_events;
+    int saved_optimize=optimize_keys;
+    ts_policy saved_ts=timestamp_policy;
+
+    fprintf(json,"{\n  \"version\": \"%s\",\n  \"output\": \"%s\",\n  \"batch\": %d,\n  \"simd\": \"%s\",\n",
+            VERSION,(out.type==SINK_UINPUT)?"uinput":((out.type==SINK_NULL)?"null":"capture"),saved_batch,ascii_run_name());
+    fprintf(json,"  \"corpus_bytes\": %d,\n  \"results\": [",BENCH_CORPUS_SIZE);
+
+    printf("%-10s %-7s %-6s %12s %12s %8s %9s %9s %9s %9s\n",
+           "corpus","stamp","path","chars/sec","events/sec","ev/char","sys/char","p50(ns)","p99(ns)","p999(ns)");
+
+    int first=1;
+    for (size_t c=0; c<sizeof(corpora)/sizeof(corpora[0]); c++) {
+        bench_corpus(corpora[c],buffer,BENCH_CORPUS_SIZE,BENCH_SEED);
+        if ((ftruncate(memfd,0))||(pwrite(memfd,buffer,BENCH_CORPUS_SIZE,0)!=BENCH_CORPUS_SIZE)) {
+            error(EXIT_FAILURE,errno,"Unable to write benchmark corpus");
+            /* no return */
+        }
+
+        for (int t=0; t<2; t++) {
+            timestamp_policy=(ts_policy)t;
 
-    /* if modifier needed, hold it down */
-    if (need_ctrl) {
-        send_event(EV_KEY, KEY_LEFTCTRL, 1);
-    }
-    if (need_shift) {
-        send_event(EV_KEY, KEY_LEFTSHIFT, 1);
-    }
+            /* latency, one keystroke at a time, each written on its own */
+            batch_events=0;
+            optimize_keys=0;
+            for (int i=0; i<BENCH_LATENCY_SAMPLES; i++) {
+                struct timespec t0, t1;
+                clock_gettime(CLOCK_MONOTONIC,&t0);
+                sendchar(buffer[i%BENCH_CORPUS_SIZE]);
+                clock_gettime(CLOCK_MONOTONIC,&t1);
+                samples[i]=(unsigned long)((t1.tv_sec-t0.tv_sec)*1000000000L+(t1.tv_nsec-t0.tv_nsec));
+            }
+            qsort(samples,BENCH_LATENCY_SAMPLES,sizeof(samples[0]),bench_compare);
+            unsigned long p50=samples[BENCH_LATENCY_SAMPLES/2];
+            unsigned long p99=samples[(BENCH_LATENCY_SAMPLES*99)/100];
+            unsigned long p999=samples[(BENCH_LATENCY_SAMPLES*999)/1000];
 
-    /* press key */
-    send_event(EV_KEY, key, 1);
+            /* throughput, file path as -f would do it, a byte at a time, */
+            /* in bulk, then through the optimizer                        */
+            for (int b=0; b<3; b++) {
+                bulk_enabled=(b==1);
+                optimize_keys=(b==2)?BENCH_OPTIMIZE:0;
+                batch_events=saved_batch;
+                unsigned long chars=stat_chars, events=out.events, writes=out.writes, reads=stat_reads;
+                double start=now_seconds();
+                connect_file(memfd_name);
+                double elapsed=now_seconds()-start;
+                chars=stat_chars-chars;
+                events=out.events-events;
+                writes=out.writes-writes;
+                reads=stat_reads-reads;
 
-    /* release key */
-    send_event(EV_KEY, key, 0);
+                if (elapsed<=0) {
+                    elapsed=1e-9;
+                }
+                double cps=(double)chars/elapsed;
+                double eps=(double)events/elapsed;
+                double spc=chars?(double)(writes+reads)/(double)chars:0.0;
 
-    /* now release the modifiers */
-    if (need_shift) {
-        send_event(EV_KEY, KEY_LEFTSHIFT, 0);
-    }
-    if (need_ctrl) {
-        send_event(EV_KEY, KEY_LEFTCTRL, 0);
-    }
-    send_report_event();
-    /* did we send a carriage return? (or linefeed?) */
-    if ((any_key==13)||(any_key==10)) {
-        /* rdelay overrides cdelay if present */
-        if (rdelay>=0) {
-            /* this allows -c 50 -r 0, pause after chars, but no pause on cr's */
-            if (rdelay>0) {
-                usleep(rdelay*1000);
+                printf("%-10s %-7s %-6s %12.0f %12.0f %8.2f %9.4f %9lu %9lu %9lu\n",
+                       corpora[c],ts_names[t],paths[b],cps,eps,chars?(double)events/(double)chars:0.0,spc,p50,p99,p999);
+                fprintf(json,"%s\n    { \"corpus\": \"%s\", \"timestamp\": \"%s\", \"path\": \"%s\", \"chars\": %lu, \"events\": %lu, "
+                        "\"writes\": %lu, \"reads\": %lu, \"seconds\": %.6f, \"chars_per_sec\": %.0f, "
+                        "\"events_per_sec\": %.0f, \"ns_per_char\": %.3f, \"syscalls_per_char\": %.6f, "
+                        "\"latency_ns\": { \"p50\": %lu, \"p99\": %lu, \"p999\": %lu } }",
+                        first?"":",",corpora[c],ts_names[t],paths[b],chars,events,writes,reads,elapsed,cps,eps,
+                        chars?elapsed*1e9/(double)chars:0.0,spc,p50,p99,p999);
+                first=0;
             }
-        } else if (cdelay>0) {
-            usleep(cdelay*1000);
-        }
-    } else {
-        /* any other character, delay if specified */
-        if (cdelay>0) {
-            usleep(cdelay*1000);
         }
     }
-}
+    fprintf(json,"\n  ]\n}\n");
 
-/* perform initial setup to create uinput device */
-static void create_uinput(void)
-{
-    /* Attempt to open uinput to create new device */
-    ufile = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-    if (ufile<0) {
-        error(1, errno, "Could not open uinput device");
+    verbose_mode=saved_verbose;
+    batch_events=saved_batch;
+    timestamp_policy=saved_ts;
+    bulk_enabled=1;
+    optimize_keys=saved_optimize;
+    close(memfd);
+    free(samples);
+    free(buffer);
+    if (json!=stdout) {
+        fclose(json);
     }
+}
 
-    /* structure with name and other info */
-    struct uinput_user_dev uinp;
-    memset(&uinp, 0, sizeof(uinp));
-
-    strncpy(uinp.name, "Faux Keyboard [TODO: & Mouse]", UINPUT_MAX_NAME_SIZE-1);
+/* Load mode, -N: many devices at once, each with its own output (and */
+/* so its own queue, optimizer state & totals), corpus and schedule,  */
+/* shared out among worker threads.  Text is typed from a table built */
+/* once up front, so workers only ever read the layout.               */
+#define LOAD_CORPUS_SIZE (64*1024)
+#define LOAD_BURST 32
+static const int LOAD_DEVICES_MAX=256;
+static int load_devices=0;
+static int load_threads=0;
+static int load_seconds=10;
 
-    uinp.id.bustype = BUS_USB;
+typedef struct {
+    sink snk;
+    char spec[PATH_MAX+16];
+    char corpus[LOAD_CORPUS_SIZE];
+    size_t next;
+    /* when its next character is due (0 is now), and how far apart */
+    long long due;
+    long long gap;
+    unsigned long chars;
+    latency_hist write_ns;
+} load_device;
 
-    /* made up values, but didn't find anything using these values */
-    uinp.id.vendor  = 0x9642;
-    uinp.id.product = 0x0d0d;
-    uinp.id.version = 13;
+typedef struct {
+    load_device* devs;
+    int first;
+    int step;
+    long long end;
+} load_worker;
 
-    /* we handle EV_SVN, EV_KEY & EV_REP events */
-    ioctl(ufile, UI_SET_EVBIT, EV_SYN);
-    ioctl(ufile, UI_SET_EVBIT, EV_KEY);
-    ioctl(ufile, UI_SET_EVBIT, EV_REP);
+/* ASCII, ready to go, read by every worker */
+static keytemplate load_keys[128];
 
-    /* enable handling of all keys */
-    for (int i=0; i<256; i++) {
-        ioctl(ufile, UI_SET_KEYBIT, i);
+/* type on one device: a character if it's paced, a burst if not, */
+/* then time the write                                             */
+static void load_send(load_device* dev)
+{
+    int count=(dev->gap)?1:LOAD_BURST;
+    for (int i=0; i<count; i++) {
+        const keytemplate* tmpl=&load_keys[dev->corpus[dev->next]&0x7f];
+        if (++dev->next==LOAD_CORPUS_SIZE) {
+            dev->next=0;
+        }
+        if (tmpl->count) {
+            queue_frame(&dev->snk, tmpl->events, tmpl->count);
+            dev->chars++;
+        }
     }
 
-    /* write data out to prepare for the magic */
-    ssize_t res=write(ufile, &uinp, sizeof(uinp));
-    if (res!=sizeof(uinp)) {
-        close(ufile);
-        error(2, errno, "Write error: %d (actual) != %d (expected)", (signed int)res, (signed int)sizeof(uinp));
-        /* no return */
+    unsigned long writes=dev->snk.writes;
+    long long t0=now_ns();
+    flush_events(&dev->snk);
+    if (dev->snk.writes!=writes) {
+        hist_add(&dev->write_ns, now_ns()-t0);
     }
-
-    /* magic happens here, honest */
-    int retcode = ioctl(ufile, UI_DEV_CREATE);
-    if (retcode) {
-        close(ufile);
-        error(2, errno, "Ioctl error: %d", retcode);
-        /* no return */
+    if (dev->gap) {
+        dev->due+=dev->gap;
     }
 }
 
-/* tear down uinput device and close file descriptor */
-static void destroy_uinput(void)
-{
-    /* skip checking retval, not concerned */
-    ioctl(ufile, UI_DEV_DESTROY);
-    close(ufile);
-    /* mark it invalid */
-    ufile=-1;
-}
-
-static void connect_user(int escape_char)
+/* a worker looks after every step'th device from first, until the end */
+static void* load_run(void* arg)
 {
-    /* set input to nonblocking/raw mode */
-    set_keyboard(KBD_MODE_RAW);
+    load_worker* work=arg;
 
-    /* state machine to find escape sequence */
-    int escape_sequence_state=0;
-
-    /* build fd_set for select */
-    fd_set readfds;
-    FD_ZERO(&readfds);
-
-    while (1) {
-        /* listen for stdin */
-        FD_SET(0,&readfds);
-        int sel=select(1,&readfds,NULL,NULL,NULL);
-        if (sel<0) {
-            /* something bad happened */
-            perror("Error during select");
+    while (!abort_requested) {
+        long long now=now_ns();
+        if (now>=work->end) {
             break;
         }
 
-        /* loop to process ALL chars in queue */
-        while (1) {
-            /* supposed to be a character ready */
-            int chr=getchar();
-
-            /* we're out of characters */
-            if (chr==EOF) {
-                break;
-            }
-
-            /* state machine to handle escape code */
-            switch (escape_sequence_state) {
-                case 2: /* 2 = looking for period */
-                    escape_sequence_state=(chr=='.')?3:0;
-                    break;
-                case 1: /* 1 = looking for escape_char */
-                    escape_sequence_state=(chr==escape_char)?2:0;
-                    break;
-                default: /* 0 = looking for CR */
-                    escape_sequence_state=(chr==13)?1:0;
-                    break;
-            }
-
-            if (escape_sequence_state==3) {
-                break;
+        /* everything that's due goes, then wait for the next */
+        long long next=work->end;
+        for (int i=work->first; i<load_devices; i+=work->step) {
+            load_device* dev=&work->devs[i];
+            if (dev->due<=now) {
+                load_send(dev);
             }
-
-            /* send typed character to uinput device */
-            sendchar(chr);
-
-            /* verbose output? (very verbose!) */
-            if (verbose_mode>2) {
-                /* -vvv : show hex value of char */
-                putchar("0123456789abcdef"[chr/16]);
-                putchar("0123456789abcdef"[chr%16]);
-                if (chr>' ') {
-                    putchar(' ');
-                    putchar(chr);
-                }
-                putchar('\n');
-            } else if (verbose_mode>1) {
-                /* -vv : echo char locally */
-                putchar(chr);
+            if (dev->due<next) {
+                next=dev->due;
             }
         }
-        if (escape_sequence_state==3) {
-            break;
+        if (next>now_ns()) {
+            sleep_until(next);
         }
     }
-
-    /* set input to 'normal' mode */
-    set_keyboard(KBD_MODE_NORMAL);
+    return NULL;
 }
 
-static void connect_string(char* sendstr)
+/* print one line of the load report, and return events/sec */
+static double load_line(const char* name, unsigned long chars, unsigned long events, unsigned long writes,
+                        const latency_hist* hist, double elapsed)
 {
-    if (verbose_mode>0) {
-        printf("Sending string: %s\n",sendstr);
-    }
-    while (*sendstr) {
-        sendchar(*sendstr);
-        if (verbose_mode>1) {
-            putchar(*sendstr);
-        }
-        sendstr++;
-    }
+    double eps=(double)events/elapsed;
+    printf("%-6s %12.0f %12.0f %10lu %9lld %9lld %9lld %9lld\n",name,(double)chars/elapsed,eps,writes,
+           hist->count?hist->total/(long long)hist->count:0LL,hist_percentile(hist,50),
+           hist_percentile(hist,99),hist->max);
+    return eps;
 }
 
-static void connect_file(char* filename)
+static int run_load(const char* output)
 {
+    static const char* corpora[]={ "lowercase", "shifted", "control", "script" };
+
+    /* no uinput here? then find out what the load costs us, at least */
+    if ((strcmp(output,"uinput")==0)&&(access("/dev/uinput",W_OK))) {
+        error(0,errno,"No uinput, typing into capture:/dev/null instead");
+        output="capture:/dev/null";
+    }
+    if ((strcmp(output,"uinput"))&&(strcmp(output,"null"))&&(strncmp(output,"capture:",8))) {
+        error(EXIT_FAILURE,0,"Load mode (-N) types into uinput, null or capture: outputs only");
+        /* no return */
+    }
 
-    char buffer[1024+1];
+    load_device* devs=calloc((size_t)load_devices,sizeof(devs[0]));
+    if (devs==NULL) {
+        error(EXIT_FAILURE,errno,"Out of memory");
+        /* no return */
+    }
 
-    if (verbose_mode>0) {
-        printf("Sending file: %s\n",filename);
+    for (uint32_t chr=0; chr<128; chr++) {
+        uint32_t entry=layout_entry(layout,chr);
+        if (entry) {
+            load_keys[chr].codepoint=chr;
+            load_keys[chr].count=expand_strokes(layout_strokes(layout,entry),(int)(entry>>24),load_keys[chr].events);
+        }
     }
 
-    FILE* fp=fopen(filename,"r");
+    /* devices one at a time, uinput doesn't like being rushed; captures */
+    /* get a file each, unless they're going nowhere anyway              */
+    long long start=now_ns();
+    for (int i=0; i<load_devices; i++) {
+        load_device* dev=&devs[i];
+        if ((strncmp(output,"capture:",8)==0)&&(strcmp(output+8,"/dev/null"))) {
+            snprintf(dev->spec,sizeof(dev->spec),"%s.%d",output,i);
+        } else {
+            snprintf(dev->spec,sizeof(dev->spec),"%s",output);
+        }
+        dev->snk.fd=-1;
+        dev->snk.frame=1;
+        open_sink(&dev->snk,dev->spec);
+        bench_corpus(corpora[i%4],dev->corpus,LOAD_CORPUS_SIZE,BENCH_SEED+(unsigned int)i);
+
+        /* paced devices start spread out, not all at once */
+        dev->gap=pace.gap;
+        dev->due=dev->gap?(dev->gap*i)/load_devices:0;
+    }
+    if (verbose_mode) {
+        fprintf(stderr,"Load: %d devices set up in %.3fms\n",load_devices,(double)(now_ns()-start)/1e6);
+    }
 
-    if (fp==NULL) {
-        perror("Error opening file for reading");
-        exit(1);
+    int threads=load_threads;
+    if (threads<=0) {
+        threads=(int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if ((threads<1)||(threads>load_devices)) {
+        threads=(threads<1)?1:load_devices;
+    }
+    pthread_t* tids=calloc((size_t)threads,sizeof(tids[0]));
+    load_worker* work=calloc((size_t)threads,sizeof(work[0]));
+    if ((tids==NULL)||(work==NULL)) {
+        error(EXIT_FAILURE,errno,"Out of memory");
+        /* no return */
     }
 
-    while (1) {
-        size_t num_read=fread(buffer,1,1024,fp);
-        /* input all gone! */
-        if (num_read<1) {
-            break;
+    start=now_ns();
+    for (int i=0; i<load_devices; i++) {
+        if (devs[i].gap) {
+            devs[i].due+=start;
+        }
+    }
+    for (int t=0; t<threads; t++) {
+        work[t].devs=devs;
+        work[t].first=t;
+        work[t].step=threads;
+        work[t].end=start+(long long)load_seconds*1000000000LL;
+        if (pthread_create(&tids[t],NULL,load_run,&work[t])) {
+            error(EXIT_FAILURE,errno,"Unable to start load worker");
+            /* no return */
         }
+    }
+    for (int t=0; t<threads; t++) {
+        pthread_join(tids[t],NULL);
+    }
+    double elapsed=(double)(now_ns()-start)/1e9;
+    if (elapsed<=0) {
+        elapsed=1e-9;
+    }
 
-        char* ptr=buffer;
-        while (num_read) {
-            sendchar(*ptr);
-            if (verbose_mode>1) {
-                putchar(*ptr);
-            }
-            ptr++;
-            num_read--;
+    printf("Load: %d devices, %d threads, %.3fs, output %s, layout %s\n",
+           load_devices,threads,elapsed,output,layout->name);
+    printf("%-6s %12s %12s %10s %9s %9s %9s %9s\n",
+           "device","chars/sec","events/sec","writes","mean(ns)","p50(ns)","p99(ns)","max(ns)");
+
+    latency_hist all;
+    memset(&all,0,sizeof(all));
+    unsigned long chars=0, events=0, writes=0;
+    double eps_min=0, eps_max=0;
+    for (int i=0; i<load_devices; i++) {
+        load_device* dev=&devs[i];
+        char name[16];
+        snprintf(name,sizeof(name),"%d",i);
+        double eps=load_line(name,dev->chars,dev->snk.events,dev->snk.writes,&dev->write_ns,elapsed);
+        if ((i==0)||(eps<eps_min)) {
+            eps_min=eps;
         }
+        if (eps>eps_max) {
+            eps_max=eps;
+        }
+        chars+=dev->chars;
+        events+=dev->snk.events;
+        writes+=dev->snk.writes;
+        hist_merge(&all,&dev->write_ns);
+        close_sink(&dev->snk);
     }
+    load_line("all",chars,events,writes,&all,elapsed);
+    printf("Per device: %.0f to %.0f events/sec\n",eps_min,eps_max);
 
-    fclose(fp);
+    free(work);
+    free(tids);
+    free(devs);
+    return abort_requested?EXIT_FAILURE:EXIT_SUCCESS;
 }
 
 /* build string to show short & long option name: -h|--help */
@@ -495,11 +6357,40 @@ static void usage(const char* arg0)
         {  'V',     "version", 0,       "Show version information" },
         {  'r',     "rdelay",  1,       "Delay arg (ms) after every <RETURN> character" },
         {  'c',     "cdelay",  1,       "Delay arg (ms) after every character" },
-        {  'f',     "file",    1,       "Send contents of file 'arg'" },
+        {  'p',     "rate",    1,       "Type at arg chars/sec ('400', '400cps', '24000cpm', '80wpm')" },
+        {  'n',     "burst",   1,       "Allow bursts of arg chars at full speed within rate" },
+        {  'b',     "batch",   1,       "Write events in batches of arg (0=every keystroke)" },
+        {  't',     "timestamp", 1,     "Event timestamps: 'kernel' (default) or 'frame'" },
+        {  'O',     "optimize", 1,      "Hold modifiers across characters, press up to arg keys per frame" },
+        {  'm',     "mouse",   1,       "Pass the mouse along: 'tty' (terminal reports) or a device to grab" },
+        {  'g',     "grab",    1,       "Grab input device (or event file) 'arg', forward its events as they are" },
+        {  'x',     "script",  1,       "Run script 'arg': keys, chords, text, waits & repeats" },
+        {  'U',     "dump",    0,       "Show what scripts (-x) compile to, instead of running them" },
+        {  'N',     "load",    1,       "Load test: type corpora on arg devices at once (rate -p each), report" },
+        {  'T',     "threads", 1,       "Worker threads for -N (default one per core)" },
+        {  'W',     "duration", 1,      "Seconds -N runs for (default 10)" },
+        {  'R',     "record",  1,       "Record every event sent, with its timing, to file 'arg'" },
+        {  'P',     "replay",  1,       "Play back recording 'arg', then exit" },
+        {  'X',     "speed",   1,       "Replay speed: 1 (default, as recorded), N times as fast, or 'max'" },
+        {  'M',     "mouse-rate", 1,    "Report mouse motion at most arg times/sec (default 125)" },
+        {  'w',     "wait",    1,       "Wait up to arg ms for new device to be ready (default 1000)" },
+        {  'l',     "layout",  1,       "Keyboard layout: us (default), de, uk, a layout or keymap file" },
+        {  'K',     "compile-keymap", 1, "Compile the layout (-l) into keymap file 'arg', and exit" },
+        {  'f',     "file",    1,       "Send contents of file 'arg' ('-' for stdin)" },
         {  's',     "string",  1,       "Send string 'arg'" },
         {  'S',     "strcr",   1,       "Send string 'arg' (append CR)" },
         {  'k',     "keep",    0,       "Keep connection after sending file or string" },
+        {  'F',     "control", 1,       "While connected, also type anything written to FIFO 'arg'" },
         {  'e',     "escape",  1,       "Specify Escape Character - Default ('%')" },
+        {  'o',     "output",  1,       "Output: uinput (default), null, capture:file, fd:n, tcp:host:port, unix:path, ssh:host" },
+        {  'L',     "listen",  1,       "Be the remote end, on 'tcp:[host:]port' (loopback unless host given), 'unix:path' or '-'" },
+        {  'D',     "daemon",  1,       "Be fauxcond: keep device, take jobs on unix socket 'arg'" },
+        {  'j',     "job",     1,       "Hand -s/-S/-f to fauxcond on unix socket 'arg', then exit" },
+        {  'd',     "decode",  1,       "Decode captured event file 'arg' back to text, then exit" },
+        {  'B',     "bench",   1,       "Benchmark injection (into capture:/dev/null, unless -C -o), JSON results to 'arg', then exit" },
+        {  'Q',     "stats",   1,       "Dump stage timings to anyone connecting to unix socket 'arg'" },
+        {  'u',     "uring",   0,       "Batch event writes and reads through io_uring, where the kernel has it" },
+        {  'A',     "adaptive", 1,      "Check each line landed, via /dev/vcsaN, an echo stream or 'pty', and adapt the rate" },
         {  'C'|REQ, "connect", 0,       "Connect to CONSOLE keyboard & mouse (REQUIRED)" },
         {   0,0,0, /* compiler will concatenate these all together */
             "Connect your keyboard to system's CONSOLE KB & Mouse.\n\n"
@@ -606,6 +6497,62 @@ static void usage(const char* arg0)
     exit(EXIT_FAILURE);
 }
 
+/* be a thin client: send -s/-S/-f to fauxcond in the order given */
+static int run_jobs(const char* socket_path, int argc, char* argv[], const char* optstring, const struct option* longopt)
+{
+    char spec[sizeof(((struct sockaddr_un*)0)->sun_path)+8];
+    snprintf(spec,sizeof(spec),"unix:%s",socket_path);
+
+    pid_t child;
+    int fd=connect_remote(spec,&child);
+    int status=EXIT_SUCCESS;
+
+    /* loop through args again, to process file/string sending in order given */
+    optind=1;
+    while (status==EXIT_SUCCESS) {
+        int opt=getopt_long(argc, argv, optstring, longopt, NULL);
+        if (opt<0) {
+            break;
+        }
+
+        int failed=0;
+        if ((opt=='f')&&(strcmp(optarg,"-")==0)) {
+            failed=send_stdin_job(fd);
+        } else if (opt=='f') {
+            /* fauxcond opens it, so it needs the full path */
+            char* path=realpath(optarg,NULL);
+            if (path==NULL) {
+                error(EXIT_FAILURE,errno,"Unable to read file: '%s'",optarg);
+                /* no return */
+            }
+            failed=send_job(fd,MSG_FILE,path,strlen(path));
+            free(path);
+        } else if ((opt=='s')||(opt=='S')) {
+            size_t len=strlen(optarg);
+            char* str=malloc(len+2);
+            if (str==NULL) {
+                error(EXIT_FAILURE,errno,"Out of memory");
+                /* no return */
+            }
+            memcpy(str,optarg,len);
+            /* append CR? */
+            if (opt=='S') {
+                str[len++]='\n';
+            }
+            failed=send_job(fd,MSG_STRING,str,len);
+            free(str);
+        }
+        if (failed) {
+            status=EXIT_FAILURE;
+        }
+    }
+
+    unsigned char bye[WIRE_HEADER_SIZE]={ MSG_BYE, 0, 0, 0, 0, 0, 0, 0 };
+    write_full(fd,bye,sizeof(bye));
+    close(fd);
+    return status;
+}
+
 int main(int argc, char* argv[])
 {
     /* verify alignment of keycode array                           */
@@ -618,7 +6565,7 @@ int main(int argc, char* argv[])
     assert((sizeof(keycode)/sizeof(keycode[0]))==128);
 
     /* short options */
-    const char* optstring="hvVr:c:f:s:S:ke:C";
+    const char* optstring="hvVr:c:p:n:b:t:O:m:M:g:x:UN:T:W:R:P:X:w:l:K:f:s:S:kF:e:o:L:D:j:d:B:Q:uA:C";
 
     /* long options */
     struct option longopt[]={
@@ -627,11 +6574,40 @@ int main(int argc, char* argv[])
         { "version", 0, 0, 'V' },
         { "rdelay",  1, 0, 'r' },
         { "cdelay",  1, 0, 'c' },
+        { "rate",    1, 0, 'p' },
+        { "burst",   1, 0, 'n' },
+        { "batch",   1, 0, 'b' },
+        { "timestamp", 1, 0, 't' },
+        { "optimize", 1, 0, 'O' },
+        { "mouse",   1, 0, 'm' },
+        { "mouse-rate", 1, 0, 'M' },
+        { "grab",    1, 0, 'g' },
+        { "script",  1, 0, 'x' },
+        { "dump",    0, 0, 'U' },
+        { "load",    1, 0, 'N' },
+        { "threads", 1, 0, 'T' },
+        { "duration", 1, 0, 'W' },
+        { "record",  1, 0, 'R' },
+        { "replay",  1, 0, 'P' },
+        { "speed",   1, 0, 'X' },
+        { "wait",    1, 0, 'w' },
+        { "layout",  1, 0, 'l' },
+        { "compile-keymap", 1, 0, 'K' },
         { "file",    1, 0, 'f' },
         { "string",  1, 0, 's' },
         { "strcr",   1, 0, 'S' },
         { "keep",    0, 0, 'k' },
+        { "control", 1, 0, 'F' },
         { "escape",  1, 0, 'e' },
+        { "output",  1, 0, 'o' },
+        { "listen",  1, 0, 'L' },
+        { "daemon",  1, 0, 'D' },
+        { "job",     1, 0, 'j' },
+        { "decode",  1, 0, 'd' },
+        { "bench",   1, 0, 'B' },
+        { "stats",   1, 0, 'Q' },
+        { "uring",   0, 0, 'u' },
+        { "adaptive", 1, 0, 'A' },
         { "connect", 0, 0, 'C' },
         { 0,         0, 0, 0   },
     };
@@ -645,6 +6621,17 @@ int main(int argc, char* argv[])
     int keep_connection=0;
     int connect=0;
     int sending=0;
+    int sending_stdin=0;
+    const char* output="uinput";
+    int output_given=0;
+    const char* decode=NULL;
+    const char* layout_name=NULL;
+    const char* compile_keymap=NULL;
+    const char* bench=NULL;
+    const char* listen_addr=NULL;
+    const char* daemon_socket=NULL;
+    const char* job_socket=NULL;
+    double rate=0;
 
     /* prevent getopt_long from printing error messages */
     opterr=0;
@@ -697,15 +6684,159 @@ int main(int argc, char* argv[])
                     cdelay=delay;
                 }
                 break;
+            case 'p': /* chars per second (or minute, or words) */
+                errno=0;
+                char* unit=NULL;
+                rate=strtod(optarg,&unit);
+                if (strcmp(unit,"cpm")==0) {
+                    rate/=60.0;
+                } else if (strcmp(unit,"wpm")==0) {
+                    /* the usual five characters to a word */
+                    rate=rate*5.0/60.0;
+                } else if ((*unit)&&(strcmp(unit,"cps")!=0)) {
+                    rate=-1;
+                }
+                if ((errno)||(rate<=0)||(rate>MAX_RATE)) {
+                    error(EXIT_FAILURE,errno,"Rate (-p|--rate) invalid (0->%dcps) at '%s'\n",MAX_RATE,optarg);
+                    /* no return */
+                }
+                break;
+            case 'n': /* burst size */
+                errno=0;
+                pace.burst=(int)strtol(optarg,&unit,0);
+                if ((errno)||(*unit)||(pace.burst<1)||(pace.burst>MAX_BURST)) {
+                    error(EXIT_FAILURE,errno,"Burst (-n|--burst) out of bounds (1->%d) at '%s'\n",MAX_BURST,optarg);
+                    /* no return */
+                }
+                break;
+            case 'b': /* events per write */
+                errno=0;
+                char* endptr=NULL;
+                batch_events=strtol(optarg,&endptr,0);
+                if ((errno)||(*endptr)||(batch_events<0)||(batch_events>EVBUF_MAX)) {
+                    error(EXIT_FAILURE,errno,"Batch size (-b|--batch) out of bounds (0->%d) at '%s'\n",EVBUF_MAX,optarg);
+                    /* no return */
+                }
+                break;
+            case 'O': /* event stream optimizer, keys per frame */
+                errno=0;
+                optimize_keys=(int)strtol(optarg,&endptr,0);
+                if ((errno)||(*endptr)||(optimize_keys<1)||(optimize_keys>OPT_FRAME_MAX)) {
+                    error(EXIT_FAILURE,errno,"Keys per frame (-O|--optimize) out of bounds (1->%d) at '%s'\n",OPT_FRAME_MAX,optarg);
+                    /* no return */
+                }
+                break;
+            case 'm': /* mouse, from the terminal or a device */
+                mouse_source=optarg;
+                break;
+            case 'g': /* raw events from a device or file */
+                grab_source=optarg;
+                break;
+            case 'Q': /* stats socket */
+                stats_socket=optarg;
+                break;
+            case 'u': /* io_uring backend */
+                uring_requested=1;
+                break;
+            case 'A': /* adaptive rate, reading back from here */
+                adapt_source=optarg;
+                break;
+            case 'N': /* load test, this many devices */
+                errno=0;
+                load_devices=(int)strtol(optarg,&endptr,0);
+                if ((errno)||(*endptr)||(load_devices<1)||(load_devices>LOAD_DEVICES_MAX)) {
+                    error(EXIT_FAILURE,errno,"Devices (-N|--load) out of bounds (1->%d) at '%s'\n",LOAD_DEVICES_MAX,optarg);
+                    /* no return */
+                }
+                break;
+            case 'T': /* load test worker threads */
+                errno=0;
+                load_threads=(int)strtol(optarg,&endptr,0);
+                if ((errno)||(*endptr)||(load_threads<1)||(load_threads>LOAD_DEVICES_MAX)) {
+                    error(EXIT_FAILURE,errno,"Threads (-T|--threads) out of bounds (1->%d) at '%s'\n",LOAD_DEVICES_MAX,optarg);
+                    /* no return */
+                }
+                break;
+            case 'W': /* load test length */
+                errno=0;
+                load_seconds=(int)strtol(optarg,&endptr,0);
+                if ((errno)||(*endptr)||(load_seconds<1)||(load_seconds>86400)) {
+                    error(EXIT_FAILURE,errno,"Duration (-W|--duration) out of bounds (1->86400s) at '%s'\n",optarg);
+                    /* no return */
+                }
+                break;
+            case 'R': /* record what's sent */
+                record_file=optarg;
+                break;
+            case 'P': /* play a recording back */
+                replay_file=optarg;
+                break;
+            case 'X': /* replay speed */
+                if (strcmp(optarg,"max")==0) {
+                    replay_speed=0;
+                    break;
+                }
+                errno=0;
+                replay_speed=strtod(optarg,&endptr);
+                if ((errno)||(*endptr)||(replay_speed<=0)||(replay_speed>REPLAY_SPEED_MAX)) {
+                    error(EXIT_FAILURE,errno,"Speed (-X|--speed) out of bounds (0->%.0f, or 'max') at '%s'\n",REPLAY_SPEED_MAX,optarg);
+                    /* no return */
+                }
+                break;
+            case 'M': /* mouse motion reports/sec */
+                errno=0;
+                mouse_rate=(int)strtol(optarg,&endptr,0);
+                if ((errno)||(*endptr)||(mouse_rate<1)||(mouse_rate>MOUSE_RATE_MAX)) {
+                    error(EXIT_FAILURE,errno,"Mouse rate (-M|--mouse-rate) out of bounds (1->%d) at '%s'\n",MOUSE_RATE_MAX,optarg);
+                    /* no return */
+                }
+                break;
+            case 'l': /* keyboard layout, set up once we know how verbose */
+                layout_name=optarg;
+                break;
+            case 'K': /* build a keymap file */
+                compile_keymap=optarg;
+                break;
+            case 'w': /* device readiness */
+                errno=0;
+                ready_wait=(int)strtol(optarg,&endptr,0);
+                if ((errno)||(*endptr)||(ready_wait<0)||(ready_wait>60000)) {
+                    error(EXIT_FAILURE,errno,"Wait (-w|--wait) out of bounds (0->60000ms) at '%s'\n",optarg);
+                    /* no return */
+                }
+                break;
+            case 't': /* who stamps the events */
+                if (strcmp(optarg,"kernel")==0) {
+                    timestamp_policy=TS_KERNEL;
+                } else if (strcmp(optarg,"frame")==0) {
+                    timestamp_policy=TS_FRAME;
+                } else {
+                    error(EXIT_FAILURE,0,"Unknown timestamp policy (-t|--timestamp): '%s'\n",optarg);
+                    /* no return */
+                }
+                break;
             case 'f': /* send file */
-                /* verify file exists and is readable */
-                if (access(optarg,R_OK)) {
+                /* '-' is stdin, which leaves nothing to type with */
+                if (strcmp(optarg,"-")==0) {
+                    sending_stdin=1;
+                } else if (access(optarg,R_OK)) {
+                    /* verify file exists and is readable */
                     error(EXIT_FAILURE,errno,"Unable to read file: '%s'",optarg);
                     /* no return */
                 }
                 /* note that we're sending something */
                 sending=1;
                 break;
+            case 'x': /* run a script */
+                if (access(optarg,R_OK)) {
+                    error(EXIT_FAILURE,errno,"Unable to read script: '%s'",optarg);
+                    /* no return */
+                }
+                sending=1;
+                break;
+            case 'U': /* show compiled scripts */
+                script_dump=1;
+                break;
             case 's': /* send string */
             case 'S': /* send string + CR */
                 /* skip these for now, we'll act on them during second pass */
@@ -724,6 +6855,28 @@ int main(int argc, char* argv[])
                     /* no return */
                 }
                 break;
+            case 'F': /* control FIFO */
+                control_fifo=optarg;
+                break;
+            case 'o': /* where the events go */
+                output=optarg;
+                output_given=1;
+                break;
+            case 'L': /* remote end of remote mode */
+                listen_addr=optarg;
+                break;
+            case 'D': /* fauxcond */
+                daemon_socket=optarg;
+                break;
+            case 'j': /* client of fauxcond */
+                job_socket=optarg;
+                break;
+            case 'd': /* decode a capture instead */
+                decode=optarg;
+                break;
+            case 'B': /* benchmark instead */
+                bench=optarg;
+                break;
             case 'h': /* help */
             default:  /* or anything weird */
                 usage(arg0);
@@ -747,6 +6900,12 @@ int main(int argc, char* argv[])
         if (cdelay>=0) {
             fprintf(stderr,"Setting Character delay to %d ms\n",cdelay);
         }
+        if (rate>0) {
+            fprintf(stderr,"Setting rate to %.1f chars/sec, bursts of %d\n",rate,pace.burst);
+        }
+        if (batch_events>=0) {
+            fprintf(stderr,"Setting event batch size to %d\n",batch_events);
+        }
         /* nothing to be sent? reset keep_connection */
         keep_connection=keep_connection&sending;
         if (keep_connection) {
@@ -755,15 +6914,190 @@ int main(int argc, char* argv[])
         }
     }
 
-    if (connect==0) {
+    /* stdin can't be both a file to send and the keyboard afterwards */
+    if ((sending_stdin)&&(keep_connection)) {
+        error(EXIT_FAILURE,0,"Can't keep connection (-k) after sending stdin (-f -)");
+        /* no return */
+    }
+
+    /* compiling a keymap is all we're here for */
+    if (compile_keymap) {
+        exit(write_keymap(layout_name?layout_name:"us",compile_keymap));
+    }
+
+    /* type (or decode) through the layout asked for, else the compiled */
+    /* keymap if this system has one, else plain US                     */
+    if ((layout_name==NULL)&&(access(KEYMAP_DEFAULT,F_OK)==0)) {
+        layout_name=KEYMAP_DEFAULT;
+    }
+    select_layout(layout_name?layout_name:"us");
+    if (layout_name==NULL) {
+        /* built from keycode[], make sure every entry types what it should */
+        for (uint32_t chr=0; chr<128; chr++) {
+            uint32_t entry=layout_entry(layout,chr);
+            if (keycode[chr]==0) {
+                assert(entry==0);
+            } else {
+                struct input_event events[TEMPLATE_MAX];
+                int count=expand_strokes(layout_strokes(layout,entry),(int)(entry>>24),events);
+                assert(decode_template(events,count)==(int32_t)chr);
+            }
+        }
+    }
+
+    /* not connecting anything, just reading back a capture */
+    if (decode) {
+        decode_stream(decode);
+        exit(EXIT_SUCCESS);
+    }
+
+    /* or showing what scripts compile to */
+    if (script_dump) {
+        optind=1;
+        int opt;
+        while ((opt=getopt_long(argc, argv, optstring, longopt, NULL))>=0) {
+            if (opt=='x') {
+                connect_script(optarg);
+            }
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    /* called as fauxcond? then that's what we are */
+    if ((strcmp(arg0,"fauxcond")==0)&&(daemon_socket==NULL)) {
+        daemon_socket=FAUXCOND_SOCKET;
+    }
+
+    /* fauxcond is a listener on a unix socket which also takes jobs. */
+    /* It never reads the keyboard, so there's nothing to get stuck in */
+    static char daemon_addr[sizeof(((struct sockaddr_un*)0)->sun_path)+8];
+    if (daemon_socket) {
+        snprintf(daemon_addr,sizeof(daemon_addr),"unix:%s",daemon_socket);
+        listen_addr=daemon_addr;
+        connect=1;
+    }
+
+    /* thin client, fauxcond does the real work */
+    if (job_socket) {
+        if (sending==0) {
+            error(EXIT_FAILURE,0,"Nothing to hand to fauxcond, use -s, -S or -f");
+            /* no return */
+        }
+        exit(run_jobs(job_socket,argc,argv,optstring,longopt));
+    }
+
+    /* benchmarks are harmless unless they're typing on the console, */
+    /* which takes -C and an output asked for by name               */
+    if ((bench)&&((connect==0)||(output_given==0))) {
+        output="capture:/dev/null";
+    }
+
+    if ((connect==0)&&(bench==NULL)) {
         fprintf(stderr,"\nConnect option not specified, preventing accidental invocation and\n"
                 "subsequent freaking out because your keyboard is dead and you didn't\n"
                 "read the man page or help.\n\n");
         exit(EXIT_FAILURE);
     }
 
-    /* set up uinput device */
-    create_uinput();
+    if (batch_events<0) {
+        batch_events=BATCH_DEFAULT;
+    }
+
+    /* -c is just a rate in disguise, -p wins if both are given */
+    if (rate>0) {
+        pace.gap=(long long)(1e9/rate);
+    } else if (cdelay>0) {
+        pace.gap=(long long)cdelay*1000000LL;
+    }
+    /* this allows -c 50 -r 0, pause after chars, but no pause on cr's */
+    if (rdelay>=0) {
+        pace.eol_gap=(long long)rdelay*1000000LL;
+    }
+
+    /* far end of remote mode (or raw mode, or replay) has no idea what keys will turn up */
+    if ((listen_addr)||(grab_source)||(replay_file)) {
+        all_keys=1;
+    }
+
+    /* never leave the console with a modifier held down */
+    atexit(emergency_release);
+    struct sigaction sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler=abort_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT,&sa,NULL);
+    sigaction(SIGTERM,&sa,NULL);
+    sigaction(SIGHUP,&sa,NULL);
+
+    /* a remote going away shows up as EPIPE, not sudden death */
+    signal(SIGPIPE,SIG_IGN);
+
+    /* timings and counters, dumped on SIGUSR1 or -Q, and at exit */
+    stats_start();
+
+    /* many devices of its own, rather than the one */
+    if (load_devices) {
+        /* one recording, written by every worker at once, would be junk */
+        if (record_file) {
+            error(EXIT_FAILURE,0,"Can't record (-R) in load mode (-N)");
+            /* no return */
+        }
+        exit(run_load(output));
+    }
+
+    /* scripts' keys have to be on the device from the start */
+    optind=1;
+    int script_opt;
+    while ((script_opt=getopt_long(argc, argv, optstring, longopt, NULL))>=0) {
+        if (script_opt=='x') {
+            script_keys(optarg);
+        }
+    }
+
+    /* set up uinput device (or whatever output was asked for) */
+    open_sink(&out,output);
+
+    /* echo can't keep up with typing?  then it waits, typing doesn't. */
+    /* (after the output's open, which decides where echo goes)        */
+    if (verbose_mode>1) {
+        log_start();
+    }
+    if (record_file) {
+        record_open(record_file);
+    }
+    if (uring_requested) {
+        uring_open(&out);
+    }
+    if (adapt_source) {
+        adapt_open(adapt_source);
+    }
+
+    /* far end of remote mode, just pass along what arrives */
+    if (listen_addr) {
+        serve_remote(listen_addr, daemon_socket!=NULL);
+        close_sink(&out);
+        return abort_requested?EXIT_FAILURE:EXIT_SUCCESS;
+    }
+
+    if (bench) {
+        run_bench(bench);
+        close_sink(&out);
+        exit(EXIT_SUCCESS);
+    }
+
+    /* a recording played back, as it was sent */
+    if (replay_file) {
+        int failed=replay_events(replay_file);
+        close_sink(&out);
+        return ((failed)||(abort_requested))?EXIT_FAILURE:EXIT_SUCCESS;
+    }
+
+    /* raw mode, nothing typed, just passed along */
+    if (grab_source) {
+        int failed=grab_input(grab_source);
+        close_sink(&out);
+        return ((failed)||(abort_requested))?EXIT_FAILURE:EXIT_SUCCESS;
+    }
 
     /* loop through args again, to process file/string sending in order given */
     optind=1;
@@ -771,15 +7105,20 @@ int main(int argc, char* argv[])
     while (1) {
         int opt=getopt_long(argc, argv, optstring, longopt, NULL);
 
-        /* no more options? */
-        if (opt<0) {
+        /* no more options? or told to stop? */
+        if ((opt<0)||(abort_requested)) {
             /* exit while loop */
             break;
         }
 
         switch (opt) {
             case 'f': /* send file */
-                connect_file(optarg);
+                if (connect_file(optarg)) {
+                    exit(1);
+                }
+                break;
+            case 'x': /* run script */
+                connect_script(optarg);
                 break;
             case 's': /* send string */
             case 'S': /* send string + CR */
@@ -788,7 +7127,7 @@ int main(int argc, char* argv[])
                 if (opt=='S') {
                     sendchar('\n');
                     if (verbose_mode>1) {
-                        putchar('\n');
+                        log_write("\n",1);
                     }
                 }
                 break;
@@ -797,14 +7136,18 @@ int main(int argc, char* argv[])
         }
     }
 
-    if (((sending)&&(keep_connection))||(sending==0)) {
-        printf("Reminder: Escape sequence is '<CR> %c .'\n",escape_char);
+    if ((abort_requested==0)&&(((sending)&&(keep_connection))||(sending==0))) {
+        log_printf("Reminder: Escape sequence is '<CR> %c .'\n",escape_char);
         connect_user(escape_char);
     }
 
     /* remove everything */
-    destroy_uinput();
+    close_sink(&out);
 
+    if (abort_requested) {
+        fprintf(stderr,"Interrupted, all keys released\n");
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }
 